@@ -105,6 +105,38 @@ buf_append_buf(Buffer *dest, Buffer *src)
     dest->n_items += src->n_items;
 }
 
+// Appends n in decimal, two digits at a time, without printf()
+void
+buf_append_num(Buffer *b, long long n)
+{
+    static const char digits[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = n < 0 ?
+        -(unsigned long long) n : (unsigned long long) n;
+
+    while (u >= 100) {
+        int i = (u % 100) * 2;
+        u /= 100;
+        *--p = digits[i + 1];
+        *--p = digits[i];
+    }
+    if (u >= 10) {
+        *--p = digits[u * 2 + 1];
+        *--p = digits[u * 2];
+    } else {
+        *--p = '0' + u;
+    }
+    if (n < 0) *--p = '-';
+
+    buf_append(b, p, tmp + sizeof(tmp) - p);
+}
+
 // Does not copy the null terminator
 int
 buf_sprintf(Buffer *buf, char *fmt, ...)
@@ -7,6 +7,9 @@
 
 #define BUFFER_GROWTH 4096
 
+// Appends a string literal without strlen()
+#define BUF_APPEND_LIT(b, lit) buf_append((b), (lit), sizeof(lit) - 1)
+
 typedef struct {
     char *data;
     size_t n_items; // Number items in data
@@ -24,6 +27,7 @@ void buf_push(Buffer *b, char c);
 void buf_append(Buffer *b, char *src, size_t n);
 void buf_append_str(Buffer *b, char *str);
 void buf_append_buf(Buffer *dest, Buffer *src);
+void buf_append_num(Buffer *b, long long n);
 int buf_sprintf(Buffer *buf, char *fmt, ...);
 int buf_append_file_contents(Buffer *buf, File *f, char *path);
 
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include "bufpool.h"
+
+void
+buf_pool_init(Buf_Pool *p, size_t small_tier, size_t large_tier)
+{
+    p->sizes[0] = small_tier;
+    p->sizes[1] = large_tier;
+    for (int i = 0; i < BUF_POOL_TIERS; i++)
+        p->n_free[i] = 0;
+}
+
+void
+free_buf_pool_parts(Buf_Pool *p)
+{
+    for (int i = 0; i < BUF_POOL_TIERS; i++) {
+        while (p->n_free[i] > 0)
+            free_buf(p->free[i][--p->n_free[i]]);
+    }
+}
+
+// Returns an empty buffer of the smallest tier that holds min_size
+// bytes, or NULL if none does
+Buffer*
+buf_pool_get(Buf_Pool *p, size_t min_size)
+{
+    for (int i = 0; i < BUF_POOL_TIERS; i++) {
+        if (p->sizes[i] < min_size)
+            continue;
+
+        if (p->n_free[i] == 0)
+            return new_buf(p->sizes[i]);
+
+        Buffer *b = p->free[i][--p->n_free[i]];
+        b->n_items = 0;
+        return b;
+    }
+    return NULL;
+}
+
+void
+buf_pool_put(Buf_Pool *p, Buffer *b)
+{
+    if (!b) return;
+
+    for (int i = 0; i < BUF_POOL_TIERS; i++) {
+        if (b->n_alloc == p->sizes[i] && p->n_free[i] < BUF_POOL_KEEP) {
+            p->free[i][p->n_free[i]++] = b;
+            return;
+        }
+    }
+    free_buf(b);
+}
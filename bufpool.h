@@ -0,0 +1,27 @@
+#ifndef _MIMINO_BUFPOOL_H
+#define _MIMINO_BUFPOOL_H
+
+#include <stddef.h>
+#include "buffer.h"
+
+#define BUF_POOL_TIERS 2
+#define BUF_POOL_KEEP  16 // free buffers kept per tier
+
+/*
+  Free lists of large buffers in a few fixed sizes. Request buffers
+  start small and borrow one of these only while a big request head
+  is being read, so idle connections stay cheap. Buffers that don't
+  fit a tier, or would overflow its free list, are freed instead.
+*/
+typedef struct {
+    size_t sizes[BUF_POOL_TIERS]; // ascending
+    Buffer *free[BUF_POOL_TIERS][BUF_POOL_KEEP];
+    int n_free[BUF_POOL_TIERS];
+} Buf_Pool;
+
+void buf_pool_init(Buf_Pool *p, size_t small_tier, size_t large_tier);
+void free_buf_pool_parts(Buf_Pool *p);
+Buffer* buf_pool_get(Buf_Pool *p, size_t min_size);
+void buf_pool_put(Buf_Pool *p, Buffer *b);
+
+#endif // _MIMINO_BUFPOOL_H
@@ -2,12 +2,14 @@
 #include "connection.h"
 #include "http.h"
 
+// Keeps the generation of slot i, which close_connection() bumps
 Connection
 make_connection(int fd, Server *s, nfds_t i)
 {
     return (Connection) {
         .fd = fd,
-        .pollfd = s->queue.pollfds + i,
+        .slot = i,
+        .gen = get_conn(&s->queue, i)->gen,
         .state = CONN_STATE_READING,
         .req = NULL,
         .res = NULL,
@@ -15,9 +17,45 @@ make_connection(int fd, Server *s, nfds_t i)
         .write_tries_left = 5,
         .keep_alive = 1,
         .last_active = s->time_now,
+        .deadline_ms = 0,
+        .deficit = 0,
+        .deferred = 0,
+        .n_chained = 0,
+        .corked = 0,
+        .linger = 0,
+        .shut_wr = 0,
     };
 }
 
+Connection*
+get_conn(Poll_Queue *q, nfds_t i)
+{
+    return q->conn_chunks[i / CONN_CHUNK_SIZE] + i % CONN_CHUNK_SIZE;
+}
+
+// Handles stay unique across slot reuse, so timers and other
+// deferred work can hold on to them after the connection is gone
+uint64_t
+get_conn_handle(Connection *conn)
+{
+    return ((uint64_t) conn->gen << 32) | (uint32_t) conn->slot;
+}
+
+// Returns NULL if the connection of handle was closed since
+Connection*
+get_conn_by_handle(Poll_Queue *q, uint64_t handle)
+{
+    nfds_t i = (uint32_t) handle;
+    if (i >= q->n_conns || q->pollfds[i].fd == -1)
+        return NULL;
+
+    Connection *conn = get_conn(q, i);
+    if (conn->gen != (unsigned) (handle >> 32))
+        return NULL;
+
+    return conn;
+}
+
 void
 free_connection_parts(Connection *conn)
 {
@@ -44,11 +82,14 @@ print_connection(struct pollfd *pfd, Connection *conn)
 
     printf("(Connection) {\n");
     printf("  .fd = %i,\n", conn->fd);
+    printf("  .slot = %lu,\n", (unsigned long) conn->slot);
+    printf("  .gen = %u,\n", conn->gen);
     printf("  .state = %i,\n", conn->state);
     printf("  .read_tries_left = %d,\n", conn->read_tries_left);
     printf("  .write_tries_left = %d,\n", conn->write_tries_left);
     printf("  .keep_alive = %d,\n", conn->keep_alive);
     printf("  .last_active = %ld,\n", (long) conn->last_active);
+    printf("  .deadline_ms = %lld,\n", conn->deadline_ms);
     printf("  .req = ");
     print_http_request(stdout, conn->req);
     printf("  .res = \n");
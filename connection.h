@@ -5,6 +5,9 @@
 #include "mimino.h"
 
 Connection make_connection(int fd, Server *serv, nfds_t i);
+Connection* get_conn(Poll_Queue *q, nfds_t i);
+uint64_t get_conn_handle(Connection *conn);
+Connection* get_conn_by_handle(Poll_Queue *q, uint64_t handle);
 void free_connection_parts(Connection *conn);
 void print_connection(struct pollfd *pfd, Connection *conn);
 
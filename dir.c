@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "dir.h"
 #include "ascii.h"
 #include "xmalloc.h"
@@ -377,6 +379,35 @@ read_file_info(File *f, char *path)
     return 1;
 }
 
+// Opens the file for reading and refreshes its size and
+// modification time from the opened fd, in case it was replaced
+// after read_file_info(). The fd is closed by free_file_parts()
+// and its stat is stored in *sb. Returns 1 on success, -1 if the
+// file doesn't exist and -2 on other errors.
+int
+open_file(File *f, char *path, struct stat *sb)
+{
+    f->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (f->fd == -1) {
+        int saved_errno = errno;
+        perror("open() inside open_file()");
+        return saved_errno == ENOENT ? -1 : -2;
+    }
+
+    if (fstat(f->fd, sb) == -1) {
+        perror("fstat() inside open_file()");
+        close(f->fd);
+        f->fd = -1;
+        return -2;
+    }
+
+    f->mode = sb->st_mode;
+    f->size = sb->st_size;
+    f->last_mod = sb->st_mtime;
+    f->is_dir = S_ISDIR(sb->st_mode);
+    return 1;
+}
+
 File_List*
 ls(char *path)
 {
@@ -446,6 +477,10 @@ free_file_parts(File *f)
     if (!f) return;
     if (f->is_null) return;
 
+    if (f->fd != -1) {
+        close(f->fd);
+        f->fd = -1;
+    }
     free(f->name);
 }
 
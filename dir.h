@@ -2,6 +2,7 @@
 #define _MIMINO_DIR_H
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
 
 #define TB_SIZE 0xE8D4A51000
@@ -37,6 +38,7 @@ char* get_base_name(char *path);
 char* cleanup_path(char *path);
 char* resolve_path(char *p1, char *p2);
 int read_file_info(File *f, char *path);
+int open_file(File *f, char *path, struct stat *sb);
 void print_file_info(FILE *f, File *file);
 char* get_file_type_suffix(File *f);
 char* get_human_file_size(off_t size);
@@ -0,0 +1,197 @@
+// fcache - cache of open files shared by responses
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fcache.h"
+#include "xmalloc.h"
+
+// FNV-1a
+static size_t
+hash_path(char *path)
+{
+    size_t h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+free_entry(Fcache_Entry *e)
+{
+    if (e->fd != -1) close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+static void
+lru_unlink(Fcache *c, Fcache_Entry *e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else c->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+lru_push_head(Fcache *c, Fcache_Entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if (c->lru_head) c->lru_head->lru_prev = e;
+    c->lru_head = e;
+    if (!c->lru_tail) c->lru_tail = e;
+}
+
+// Takes e out of the cache. It's freed right away if no response
+// is using it, otherwise by the last fcache_release().
+static void
+drop_entry(Fcache *c, Fcache_Entry *e)
+{
+    Fcache_Entry **p = c->buckets + (hash_path(e->path) & (c->n_buckets - 1));
+    while (*p != e) p = &(*p)->hash_next;
+    *p = e->hash_next;
+    e->hash_next = NULL;
+
+    lru_unlink(c, e);
+    e->in_cache = 0;
+    c->n_entries--;
+
+    if (e->refs == 0)
+        free_entry(e);
+}
+
+static int
+same_file(struct stat *a, struct stat *b)
+{
+    return a->st_dev == b->st_dev &&
+        a->st_ino == b->st_ino &&
+        a->st_size == b->st_size &&
+        a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+        a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+void
+fcache_init(Fcache *c, size_t max_entries)
+{
+    *c = (Fcache) { .max_entries = max_entries };
+    if (max_entries == 0) return;
+
+    c->n_buckets = 16;
+    while (c->n_buckets < max_entries * 2) c->n_buckets *= 2;
+    c->buckets = xmalloc(sizeof(c->buckets[0]) * c->n_buckets);
+    memset(c->buckets, 0, sizeof(c->buckets[0]) * c->n_buckets);
+}
+
+void
+free_fcache_parts(Fcache *c)
+{
+    while (c->lru_head)
+        drop_entry(c, c->lru_head);
+    free(c->buckets);
+    c->buckets = NULL;
+}
+
+// Returns a referenced entry for path or NULL if it isn't cached
+// or changed on disk since it was
+Fcache_Entry*
+fcache_get(Fcache *c, char *path, long long now_ms)
+{
+    if (c->max_entries == 0) return NULL;
+
+    Fcache_Entry *e = c->buckets[hash_path(path) & (c->n_buckets - 1)];
+    for (; e; e = e->hash_next) {
+        if (!strcmp(e->path, path)) break;
+    }
+    if (!e) return NULL;
+
+    if (now_ms - e->checked_ms >= FCACHE_VALID_MS) {
+        struct stat st;
+        if (stat(path, &st) == -1 || !same_file(&st, &e->st)) {
+            drop_entry(c, e);
+            return NULL;
+        }
+        e->checked_ms = now_ms;
+    }
+
+    lru_unlink(c, e);
+    lru_push_head(c, e);
+    e->refs++;
+    return e;
+}
+
+// Caches fd, which must have been opened from path and fstat()ed
+// into st. Returns a referenced entry that now owns fd, or NULL if
+// the cache is disabled, in which case the caller still owns fd.
+Fcache_Entry*
+fcache_put(Fcache *c, char *path, int fd, struct stat *st, long long now_ms)
+{
+    if (c->max_entries == 0) return NULL;
+
+    // Evict the least recently used entry
+    if (c->n_entries >= c->max_entries)
+        drop_entry(c, c->lru_tail);
+
+    Fcache_Entry *e = xmalloc(sizeof(Fcache_Entry));
+    *e = (Fcache_Entry) {
+        .path = xstrdup(path),
+        .fd = fd,
+        .st = *st,
+        .checked_ms = now_ms,
+        .refs = 1,
+        .in_cache = 1,
+    };
+
+    size_t b = hash_path(path) & (c->n_buckets - 1);
+    e->hash_next = c->buckets[b];
+    c->buckets[b] = e;
+    lru_push_head(c, e);
+    c->n_entries++;
+
+    return e;
+}
+
+void
+fcache_release(Fcache_Entry *e)
+{
+    if (!e) return;
+    e->refs--;
+    if (e->refs == 0 && !e->in_cache)
+        free_entry(e);
+}
+
+// Readers hold a ref of e, they have to be removed before it's
+// released
+void
+fcache_add_reader(Fcache_Entry *e, Fcache_Reader *r)
+{
+    r->next = e->readers;
+    e->readers = r;
+}
+
+void
+fcache_remove_reader(Fcache_Entry *e, Fcache_Reader *r)
+{
+    Fcache_Reader **p = &e->readers;
+    while (*p && *p != r) p = &(*p)->next;
+    if (*p) *p = r->next;
+    r->next = NULL;
+}
+
+// Returns the lowest sent_end of the readers of e, the file before
+// it isn't needed by anyone. Returns -1 while some other ref isn't
+// a reader, since it could need any part of the file.
+off_t
+fcache_readers_low(Fcache_Entry *e)
+{
+    int n = 0;
+    off_t low = -1;
+    for (Fcache_Reader *r = e->readers; r; r = r->next, n++) {
+        if (low == -1 || r->sent_end < low)
+            low = r->sent_end;
+    }
+    return n == e->refs ? low : -1;
+}
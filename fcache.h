@@ -0,0 +1,56 @@
+#ifndef _MIMINO_FCACHE_H
+#define _MIMINO_FCACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define FCACHE_DEFAULT_MAX_ENTRIES 256
+#define FCACHE_VALID_MS            1000
+
+/*
+  A bounded cache of open file descriptors keyed by resolved path.
+  Responses take a reference with fcache_get() or fcache_put() and
+  drop it with fcache_release(). Entries are compared against the
+  path's inode, size and mtime at most once every FCACHE_VALID_MS
+  and dropped when the file changed. Dropped or evicted entries
+  that are still referenced stay open until their last release.
+*/
+// A response streaming an entry's file, see fcache_readers_low()
+typedef struct Fcache_Reader {
+    off_t sent_end; // the file before this has left the socket
+    struct Fcache_Reader *next;
+} Fcache_Reader;
+
+typedef struct Fcache_Entry {
+    char *path;
+    int fd;
+    struct stat st;
+    long long checked_ms; // last time st was compared to path
+    int refs;
+    int in_cache;
+    Fcache_Reader *readers; // the refs that are streaming the file
+    struct Fcache_Entry *hash_next;
+    struct Fcache_Entry *lru_prev; // towards most recently used
+    struct Fcache_Entry *lru_next; // towards least recently used
+} Fcache_Entry;
+
+typedef struct {
+    Fcache_Entry **buckets;
+    size_t n_buckets;
+    size_t n_entries;
+    size_t max_entries; // 0 disables the cache
+    Fcache_Entry *lru_head;
+    Fcache_Entry *lru_tail;
+} Fcache;
+
+void fcache_init(Fcache *c, size_t max_entries);
+void free_fcache_parts(Fcache *c);
+Fcache_Entry* fcache_get(Fcache *c, char *path, long long now_ms);
+Fcache_Entry* fcache_put(Fcache *c, char *path, int fd, struct stat *st,
+                         long long now_ms);
+void fcache_release(Fcache_Entry *e);
+void fcache_add_reader(Fcache_Entry *e, Fcache_Reader *r);
+void fcache_remove_reader(Fcache_Entry *e, Fcache_Reader *r);
+off_t fcache_readers_low(Fcache_Entry *e);
+
+#endif // _MIMINO_FCACHE_H
@@ -1,9 +1,28 @@
-// fdwatch - utilities around poll
+// fdwatch - utilities around poll, epoll and io_uring
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include "fdwatch.h"
+#include "xmalloc.h"
 
-static int default_max_poll_nfds = 10000;
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 
+#ifdef HAVE_IO_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// Raises the process-wide fd limit, so call it once before
+// starting any worker threads and share the result.
 int
 fdwatch_get_max_poll_nfds()
 {
@@ -11,7 +30,7 @@ fdwatch_get_max_poll_nfds()
     struct rlimit rl;
     int status = getrlimit(RLIMIT_NOFILE, &rl);
     if (status != 0)
-        return default_max_poll_nfds;
+        return FDWATCH_DEFAULT_MAX_NFDS;
 
     // Attempt to raise the soft max fd limit
     int ret = rl.rlim_cur;
@@ -24,5 +43,1132 @@ fdwatch_get_max_poll_nfds()
     return ret;
 #endif // RLIMIT_NOFILE
 
-    return default_max_poll_nfds;
+    return FDWATCH_DEFAULT_MAX_NFDS;
+}
+
+char*
+fdwatch_backend_name(int backend)
+{
+    switch (backend) {
+    case FDWATCH_POLL:  return "poll";
+    case FDWATCH_EPOLL: return "epoll";
+    case FDWATCH_URING: return "io_uring";
+    }
+    return "unknown";
+}
+
+// Returns 0 if name isn't a known backend
+int
+fdwatch_backend_from_name(char *name)
+{
+    if (!name) return 0;
+    if (!strcmp(name, "poll"))  return FDWATCH_POLL;
+    if (!strcmp(name, "epoll")) return FDWATCH_EPOLL;
+    if (!strcmp(name, "io_uring") || !strcmp(name, "uring"))
+        return FDWATCH_URING;
+    return 0;
+}
+
+static void
+set_fd_idx(Fdwatch *fw, int fd, nfds_t i)
+{
+    if ((size_t) fd >= fw->n_fd_idx) {
+        size_t n = fw->n_fd_idx ? fw->n_fd_idx : 1024;
+        while (n <= (size_t) fd) n *= 2;
+        fw->fd_idx = xrealloc(fw->fd_idx, sizeof(fw->fd_idx[0]) * n);
+        fw->n_fd_idx = n;
+    }
+    fw->fd_idx[fd] = i;
+}
+
+// Returns the pollfd index of fd or n if it isn't in pfds[0..n)
+nfds_t
+fdwatch_get_fd_idx(Fdwatch *fw, struct pollfd *pfds, nfds_t n, int fd)
+{
+    if (fd < 0 || (size_t) fd >= fw->n_fd_idx) return n;
+    nfds_t i = fw->fd_idx[fd];
+    if (i >= n || pfds[i].fd != fd) return n;
+    return i;
+}
+
+static void
+push_ready(Fdwatch *fw, nfds_t i)
+{
+    if (fw->n_ready >= fw->n_ready_alloc) {
+        fw->n_ready_alloc = fw->n_ready_alloc ? fw->n_ready_alloc * 2 : 64;
+        fw->ready = xrealloc(fw->ready, sizeof(fw->ready[0]) * fw->n_ready_alloc);
+    }
+    fw->ready[fw->n_ready++] = i;
+}
+
+// Clear the revents left over from the last fdwatch() call
+static void
+clear_ready(Fdwatch *fw, struct pollfd *pfds, nfds_t n)
+{
+    for (nfds_t r = 0; r < fw->n_ready; r++) {
+        if (fw->ready[r] < n)
+            pfds[fw->ready[r]].revents = 0;
+    }
+    fw->n_ready = 0;
+}
+
+// What the backend does for an fd besides watching it, only io_uring
+// tells them apart
+#define FD_KIND_POLL   0
+#define FD_KIND_LISTEN 1
+#define FD_KIND_SOCK   2
+
+static int
+cmp_nfds(const void *a, const void *b)
+{
+    nfds_t x = *(const nfds_t*) a;
+    nfds_t y = *(const nfds_t*) b;
+    return (x > y) - (x < y);
+}
+
+#ifdef HAVE_IO_URING
+/*
+  The io_uring backend does the socket I/O of the server in the ring,
+  so a single io_uring_enter() accepts, receives, sends and waits for
+  all of the connections:
+
+  - The listen socket has a multishot IORING_OP_ACCEPT armed, the
+    accepted fds are queued for fdwatch_take_accepted().
+  - Connections waiting for POLLIN have an IORING_OP_RECV armed
+    that picks one of the ring's provided buffers. The data is kept
+    there until fdwatch_recv() copies it out.
+  - fdwatch_sendmsg() copies the data into an IORING_OP_SEND. Its
+    completion is reported as POLLOUT, the next send waits for it.
+
+  Anything else, and the above on kernels that can't do them, gets
+  a one-shot IORING_OP_POLL_ADD. Completed ops are re-armed on the
+  next fdwatch() call with whatever events the fd is interested in
+  by then, which keeps level-triggered semantics like poll() and
+  epoll.
+
+  user_data holds the op in the top byte, then a generation counter
+  and the fd in the low 32 bits, so that completions of ops that were
+  cancelled or belong to a closed fd can be told apart. Sends carry
+  a pointer to their Uring_Send instead.
+*/
+
+#define URING_ENTRIES  4096
+#define URING_BUFS     256 // power of 2
+#define URING_BUF_SIZE 4096
+#define URING_BGID     0
+#define URING_SEND_MAX (64 << 10)
+
+#define URING_OP_POLL   0ULL
+#define URING_OP_REMOVE 1ULL // cancellations, their completions are ignored
+#define URING_OP_ACCEPT 2ULL
+#define URING_OP_RECV   3ULL
+#define URING_OP_SEND   4ULL
+
+#define URING_GEN_MASK 0xffffff
+#define URING_UD(op, gen, fd) \
+    ((op) << 56 | (uint64_t) ((gen) & URING_GEN_MASK) << 32 | (uint32_t) (fd))
+#define URING_UD_OP(ud)  ((ud) >> 56)
+#define URING_UD_GEN(ud) ((unsigned) ((ud) >> 32) & URING_GEN_MASK)
+#define URING_UD_FD(ud)  ((int) (uint32_t) (ud))
+#define URING_UD_PTR(ud) ((void*) (uintptr_t) ((ud) & ((1ULL << 56) - 1)))
+
+// A send in flight. It outlives its connection if it has to.
+typedef struct {
+    int fd;
+    int flags;
+    size_t len;
+    size_t off;
+    char data[];
+} Uring_Send;
+
+typedef struct {
+    unsigned gen;      // of the poll, bumped when it's disarmed
+    unsigned conn_gen; // of the accept or recv, bumped on delete
+    char kind;         // FD_KIND_*
+    char watched;
+    char armed;        // poll in flight
+    char io_armed;     // accept or recv in flight
+    char queued;       // in the rearm list
+    char poll_in;      // recv ran out of buffers, poll instead
+
+    // What the last recv got, see fdwatch_recv()
+    char has_data;
+    char eof;
+    int err;
+    unsigned short bid;
+    unsigned off;
+    unsigned len;
+
+    Uring_Send *send;
+    int send_err;
+} Uring_Fd;
+
+typedef struct {
+    int ring_fd;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned sqe_tail;   // local tail, published on submit
+    unsigned sqe_pushed; // sqes already handed to the kernel
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    Uring_Fd *fds;
+    size_t n_fds;
+
+    int *rearm;
+    size_t n_rearm;
+    size_t n_rearm_alloc;
+
+    // Buffers recvs pick from, registered as a buffer ring
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *bufs;
+    unsigned short buf_tail;
+    int recv_ok; // recvs go through the ring
+
+    int listen_fd;
+    int accept_ok; // multishot accept works
+    int *accepted;
+    size_t n_accepted;
+    size_t accepted_i; // next one to take
+    size_t n_accepted_alloc;
+} Uring;
+
+static int
+uring_enter(Uring *u, unsigned wait_nr, int timeout_ms)
+{
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = u->sqe_tail - u->sqe_pushed;
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = timeout_ms < 0 ? 0 : (uint64_t) (uintptr_t) &ts,
+    };
+
+    int ret;
+    if (wait_nr) {
+        ret = syscall(__NR_io_uring_enter, u->ring_fd, to_submit, wait_nr,
+                      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                      &arg, sizeof(arg));
+    } else {
+        ret = syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 0, 0,
+                      NULL, 0);
+    }
+    if (ret >= 0) u->sqe_pushed += ret;
+    return ret;
+}
+
+static struct io_uring_sqe*
+uring_get_sqe(Uring *u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sqe_tail - head >= u->sq_entries) {
+        // SQ is full, hand it to the kernel first
+        if (uring_enter(u, 0, 0) < 0)
+            perror("io_uring_enter() inside uring_get_sqe()");
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sqe_tail - head >= u->sq_entries)
+            return NULL;
+    }
+
+    unsigned idx = u->sqe_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = u->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sqe_tail++;
+    return sqe;
+}
+
+static Uring_Fd*
+uring_fd(Uring *u, int fd)
+{
+    if ((size_t) fd >= u->n_fds) {
+        size_t n = u->n_fds ? u->n_fds : 1024;
+        while (n <= (size_t) fd) n *= 2;
+        u->fds = xrealloc(u->fds, sizeof(u->fds[0]) * n);
+        memset(u->fds + u->n_fds, 0, sizeof(u->fds[0]) * (n - u->n_fds));
+        u->n_fds = n;
+    }
+    return u->fds + fd;
+}
+
+// Returns the Uring_Fd a completion is for, or NULL if it's stale
+static Uring_Fd*
+uring_cqe_fd(Uring *u, uint64_t ud)
+{
+    int fd = URING_UD_FD(ud);
+    if ((size_t) fd >= u->n_fds) return NULL;
+
+    Uring_Fd *f = u->fds + fd;
+    unsigned gen = URING_UD_OP(ud) == URING_OP_POLL ? f->gen : f->conn_gen;
+    if (!f->watched || (gen & URING_GEN_MASK) != URING_UD_GEN(ud))
+        return NULL;
+    return f;
+}
+
+static void
+uring_queue_rearm(Uring *u, int fd)
+{
+    Uring_Fd *f = uring_fd(u, fd);
+    if (f->queued) return;
+    f->queued = 1;
+
+    if (u->n_rearm >= u->n_rearm_alloc) {
+        u->n_rearm_alloc = u->n_rearm_alloc ? u->n_rearm_alloc * 2 : 64;
+        u->rearm = xrealloc(u->rearm, sizeof(u->rearm[0]) * u->n_rearm_alloc);
+    }
+    u->rearm[u->n_rearm++] = fd;
+}
+
+// Cancels the op with the given user_data
+static void
+uring_cancel(Uring *u, int opcode, uint64_t ud)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe) {
+        fprintf(stderr, "io_uring SQ full, can't cancel fd %d\n",
+                URING_UD_FD(ud));
+        return;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->addr = ud;
+    sqe->user_data = URING_UD(URING_OP_REMOVE, 0, 0);
+}
+
+// Cancels the armed poll of fd, if any
+static void
+uring_disarm(Uring *u, int fd)
+{
+    Uring_Fd *f = uring_fd(u, fd);
+    if (f->armed) {
+        uring_cancel(u, IORING_OP_POLL_REMOVE,
+                     URING_UD(URING_OP_POLL, f->gen, fd));
+    }
+    f->armed = 0;
+    f->gen++;
+}
+
+static void
+uring_arm(Uring *u, int fd, short events)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe) {
+        // Try again on the next fdwatch()
+        uring_queue_rearm(u, fd);
+        return;
+    }
+
+    Uring_Fd *f = uring_fd(u, fd);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = URING_UD(URING_OP_POLL, f->gen, fd);
+    f->armed = 1;
+}
+
+// Arms the multishot accept of a listen fd or the recv of a socket
+static void
+uring_arm_io(Uring *u, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe) {
+        uring_queue_rearm(u, fd);
+        return;
+    }
+
+    Uring_Fd *f = uring_fd(u, fd);
+    sqe->fd = fd;
+    if (f->kind == FD_KIND_LISTEN) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = URING_UD(URING_OP_ACCEPT, f->conn_gen, fd);
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->len = URING_BUF_SIZE;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        sqe->user_data = URING_UD(URING_OP_RECV, f->conn_gen, fd);
+    }
+    f->io_armed = 1;
+}
+
+// Gives a buffer back to the ring for recvs to pick
+static void
+uring_put_buf(Uring *u, unsigned short bid)
+{
+    struct io_uring_buf *b =
+        u->buf_ring->bufs + (u->buf_tail & (URING_BUFS - 1));
+    b->addr = (uint64_t) (uintptr_t) (u->bufs + (size_t) bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Returns 0 if there's no room in the SQ
+static int
+uring_submit_send(Uring *u, Uring_Send *s)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe) return 0;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (s->data + s->off);
+    sqe->len = s->len - s->off;
+    sqe->msg_flags = s->flags | MSG_WAITALL;
+    sqe->user_data = URING_OP_SEND << 56 | (uint64_t) (uintptr_t) s;
+    return 1;
+}
+
+// Adds revents to pfds[i] and lists it as ready once
+static void
+report_ready(Fdwatch *fw, struct pollfd *pfds, nfds_t i, short revents)
+{
+    if (!pfds[i].revents)
+        push_ready(fw, i);
+    pfds[i].revents |= revents;
+}
+
+static int
+uring_does_pollin(Uring *u, Uring_Fd *f)
+{
+    if (f->kind == FD_KIND_LISTEN) return u->accept_ok;
+    if (f->kind == FD_KIND_SOCK) return u->recv_ok && !f->poll_in;
+    return 0;
+}
+
+// Arms what pfds[i].fd needs for its events. Data that has been
+// received already is reported right away.
+static void
+uring_arm_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i)
+{
+    Uring *u = fw->uring;
+    int fd = pfds[i].fd;
+    Uring_Fd *f = uring_fd(u, fd);
+    short events = pfds[i].events;
+
+    if ((events & POLLIN) && uring_does_pollin(u, f)) {
+        events &= ~POLLIN;
+        if (f->has_data || f->eof || f->err)
+            report_ready(fw, pfds, i, POLLIN);
+        else if (!f->io_armed)
+            uring_arm_io(u, fd);
+    }
+
+    // The completion of the send reports POLLOUT
+    if (f->send)
+        events &= ~POLLOUT;
+
+    if (events && !f->armed)
+        uring_arm(u, fd, events);
+}
+
+static void
+uring_poll_done(Fdwatch *fw, struct pollfd *pfds, nfds_t n,
+                struct io_uring_cqe *cqe)
+{
+    Uring_Fd *f = uring_cqe_fd(fw->uring, cqe->user_data);
+    if (!f) return;
+
+    int fd = URING_UD_FD(cqe->user_data);
+    f->armed = 0;
+    f->poll_in = 0; // buffers may be back by now
+    uring_queue_rearm(fw->uring, fd);
+    if (cqe->res == -ECANCELED) return;
+
+    nfds_t i = fdwatch_get_fd_idx(fw, pfds, n, fd);
+    if (i == n) return;
+    report_ready(fw, pfds, i, cqe->res < 0 ? POLLERR : (short) cqe->res);
+}
+
+static void
+uring_accept_done(Fdwatch *fw, struct pollfd *pfds, nfds_t n,
+                  struct io_uring_cqe *cqe)
+{
+    Uring *u = fw->uring;
+    Uring_Fd *f = uring_cqe_fd(u, cqe->user_data);
+    if (!f) {
+        // Nobody is going to take it
+        if (cqe->res >= 0) close(cqe->res);
+        return;
+    }
+
+    int fd = URING_UD_FD(cqe->user_data);
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        f->io_armed = 0;
+        uring_queue_rearm(u, fd);
+    }
+
+    if (cqe->res >= 0) {
+        if (u->n_accepted >= u->n_accepted_alloc) {
+            u->n_accepted_alloc = u->n_accepted_alloc ?
+                u->n_accepted_alloc * 2 : 64;
+            u->accepted = xrealloc(u->accepted,
+                                   sizeof(u->accepted[0]) * u->n_accepted_alloc);
+        }
+        u->accepted[u->n_accepted++] = cqe->res;
+    } else if (cqe->res == -EINVAL) {
+        // No multishot accept, the caller accepts after polls then
+        u->accept_ok = 0;
+    } else if (cqe->res != -ECANCELED) {
+        errno = -cqe->res;
+        perror("io_uring accept");
+    }
+
+    nfds_t i = fdwatch_get_fd_idx(fw, pfds, n, fd);
+    if (i != n && cqe->res != -ECANCELED)
+        report_ready(fw, pfds, i, POLLIN);
+}
+
+static void
+uring_recv_done(Fdwatch *fw, struct pollfd *pfds, nfds_t n,
+                struct io_uring_cqe *cqe)
+{
+    Uring *u = fw->uring;
+    Uring_Fd *f = uring_cqe_fd(u, cqe->user_data);
+    int res = cqe->res;
+    int has_buf = cqe->flags & IORING_CQE_F_BUFFER;
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (!f || res <= 0) {
+        if (has_buf) uring_put_buf(u, bid);
+        if (!f) return;
+    }
+
+    int fd = URING_UD_FD(cqe->user_data);
+    f->io_armed = 0;
+    uring_queue_rearm(u, fd);
+
+    if (res > 0) {
+        f->has_data = 1;
+        f->bid = bid;
+        f->off = 0;
+        f->len = res;
+    } else if (res == 0) {
+        f->eof = 1;
+    } else if (res == -ENOBUFS) {
+        // All buffers hold data nobody read yet
+        f->poll_in = 1;
+        return;
+    } else if (res == -EINVAL) {
+        // Kernel can't select buffers, recv() after polls then
+        u->recv_ok = 0;
+        return;
+    } else if (res == -ECANCELED) {
+        return;
+    } else {
+        f->err = -res;
+    }
+
+    nfds_t i = fdwatch_get_fd_idx(fw, pfds, n, fd);
+    if (i != n && (pfds[i].events & POLLIN))
+        report_ready(fw, pfds, i, POLLIN);
+}
+
+static void
+uring_send_done(Fdwatch *fw, struct pollfd *pfds, nfds_t n,
+                struct io_uring_cqe *cqe)
+{
+    Uring *u = fw->uring;
+    Uring_Send *s = URING_UD_PTR(cqe->user_data);
+    int fd = s->fd;
+    int res = cqe->res;
+
+    // Its connection is gone, fdwatch_del_fd() left it to us
+    if ((size_t) fd >= u->n_fds || u->fds[fd].send != s) {
+        free(s);
+        return;
+    }
+
+    if (res > 0 && s->off + res < s->len) {
+        // Short send, the rest goes right after
+        s->off += res;
+        if (uring_submit_send(u, s)) return;
+        res = -EBUSY;
+    }
+
+    Uring_Fd *f = u->fds + fd;
+    f->send = NULL;
+    if (res < 0) f->send_err = -res;
+    free(s);
+    uring_queue_rearm(u, fd);
+
+    nfds_t i = fdwatch_get_fd_idx(fw, pfds, n, fd);
+    if (i != n && (pfds[i].events & POLLOUT))
+        report_ready(fw, pfds, i, res < 0 ? POLLOUT | POLLERR : POLLOUT);
+}
+
+static void
+uring_free(Uring *u)
+{
+    if (u->sqes) munmap(u->sqes, u->sqes_len);
+    if (u->cq_ptr && u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_len);
+    if (u->sq_ptr) munmap(u->sq_ptr, u->sq_len);
+    if (u->buf_ring) munmap(u->buf_ring, u->buf_ring_len);
+    if (u->ring_fd != -1) close(u->ring_fd);
+    free(u->bufs);
+    free(u->fds);
+    free(u->rearm);
+    free(u->accepted);
+    free(u);
+}
+
+// Registers the recv buffers. Without them (before 5.19) sockets
+// are polled and read with recv() like the other backends do.
+static void
+uring_init_bufs(Uring *u)
+{
+    size_t len = URING_BUFS * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+        return;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) (uintptr_t) ring,
+        .ring_entries = URING_BUFS,
+        .bgid = URING_BGID,
+    };
+    if (syscall(__NR_io_uring_register, u->ring_fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        munmap(ring, len);
+        return;
+    }
+
+    u->buf_ring = ring;
+    u->buf_ring_len = len;
+    u->bufs = xmalloc((size_t) URING_BUFS * URING_BUF_SIZE);
+    for (unsigned bid = 0; bid < URING_BUFS; bid++)
+        uring_put_buf(u, bid);
+    u->recv_ok = 1;
+}
+
+// Returns NULL if io_uring can't be used
+static Uring*
+uring_init()
+{
+    Uring *u = xmalloc(sizeof(Uring));
+    memset(u, 0, sizeof(*u));
+    u->listen_fd = -1;
+    u->accept_ok = 1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->ring_fd == -1) {
+        perror("io_uring_setup() inside uring_init()");
+        free(u);
+        return NULL;
+    }
+
+    // Timeouts are passed through IORING_ENTER_EXT_ARG (5.11+)
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring: kernel lacks IORING_FEAT_EXT_ARG\n");
+        uring_free(u);
+        return NULL;
+    }
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQ_RING)");
+        u->sq_ptr = NULL;
+        uring_free(u);
+        return NULL;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                         IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            perror("mmap(IORING_OFF_CQ_RING)");
+            u->cq_ptr = NULL;
+            uring_free(u);
+            return NULL;
+        }
+    }
+
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        perror("mmap(IORING_OFF_SQES)");
+        u->sqes = NULL;
+        uring_free(u);
+        return NULL;
+    }
+
+    char *sq = u->sq_ptr;
+    u->sq_head  = (unsigned*) (sq + p.sq_off.head);
+    u->sq_tail  = (unsigned*) (sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned*) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sqe_tail = u->sqe_pushed = *u->sq_tail;
+
+    char *cq = u->cq_ptr;
+    u->cq_head = (unsigned*) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    u->cqes    = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    uring_init_bufs(u);
+    return u;
+}
+
+// Copies out what the last recv of a socket got
+static ssize_t
+uring_recv(Uring *u, int fd, void *buf, size_t len)
+{
+    Uring_Fd *f = uring_fd(u, fd);
+
+    // Whatever happens, the fd wants reporting or a new recv
+    uring_queue_rearm(u, fd);
+
+    if (f->has_data) {
+        size_t k = len < f->len ? len : f->len;
+        memcpy(buf, u->bufs + (size_t) f->bid * URING_BUF_SIZE + f->off, k);
+        f->off += k;
+        f->len -= k;
+        if (f->len == 0) {
+            f->has_data = 0;
+            uring_put_buf(u, f->bid);
+        }
+        return k;
+    }
+    if (f->err) {
+        errno = f->err;
+        f->err = 0;
+        return -1;
+    }
+    if (f->eof)
+        return 0;
+
+    // A recv is armed, reading here could overtake it
+    errno = EAGAIN;
+    return -1;
+}
+
+// Copies the message into a send of its own
+static ssize_t
+uring_sendmsg(Uring *u, int fd, struct msghdr *msg, int flags)
+{
+    Uring_Fd *f = uring_fd(u, fd);
+    if (f->send_err) {
+        errno = f->send_err;
+        f->send_err = 0;
+        return -1;
+    }
+
+    // Sends to a socket can't be reordered
+    if (f->send) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t len = 0;
+    for (size_t v = 0; v < (size_t) msg->msg_iovlen; v++)
+        len += msg->msg_iov[v].iov_len;
+    if (len > URING_SEND_MAX)
+        len = URING_SEND_MAX;
+    if (len == 0)
+        return 0;
+
+    Uring_Send *s = xmalloc(sizeof(*s) + len);
+    *s = (Uring_Send) { .fd = fd, .flags = flags, .len = len };
+    for (size_t v = 0, k = 0; k < len; v++) {
+        size_t m = msg->msg_iov[v].iov_len;
+        if (m > len - k) m = len - k;
+        memcpy(s->data + k, msg->msg_iov[v].iov_base, m);
+        k += m;
+    }
+
+    if (!uring_submit_send(u, s)) {
+        free(s);
+        return sendmsg(fd, msg, flags);
+    }
+    f->send = s;
+    return len;
+}
+
+static int
+uring_fdwatch(Fdwatch *fw, struct pollfd *pfds, nfds_t n, int timeout_ms)
+{
+    Uring *u = fw->uring;
+
+    clear_ready(fw, pfds, n);
+
+    // Re-arm the fds whose ops completed or whose events changed
+    for (size_t r = 0; r < u->n_rearm; r++) {
+        int fd = u->rearm[r];
+        Uring_Fd *f = uring_fd(u, fd);
+        f->queued = 0;
+        if (!f->watched) continue;
+
+        nfds_t i = fdwatch_get_fd_idx(fw, pfds, n, fd);
+        if (i == n || pfds[i].events == 0) continue;
+        uring_arm_fd(fw, pfds, i);
+    }
+    u->n_rearm = 0;
+
+    // Connections accepted earlier that weren't taken yet
+    if (u->accepted_i < u->n_accepted) {
+        nfds_t i = fdwatch_get_fd_idx(fw, pfds, n, u->listen_fd);
+        if (i != n) report_ready(fw, pfds, i, POLLIN);
+    }
+
+    // Don't wait when something is ready already
+    int wait = timeout_ms != 0 && fw->n_ready == 0;
+    int ret = uring_enter(u, wait, timeout_ms);
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        return -1;
+
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = u->cqes + (head & *u->cq_mask);
+        switch (URING_UD_OP(cqe->user_data)) {
+        case URING_OP_POLL:   uring_poll_done(fw, pfds, n, cqe); break;
+        case URING_OP_ACCEPT: uring_accept_done(fw, pfds, n, cqe); break;
+        case URING_OP_RECV:   uring_recv_done(fw, pfds, n, cqe); break;
+        case URING_OP_SEND:   uring_send_done(fw, pfds, n, cqe); break;
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    qsort(fw->ready, fw->n_ready, sizeof(fw->ready[0]), cmp_nfds);
+    return fw->n_ready;
+}
+#endif // HAVE_IO_URING
+
+// Returns the backend that was actually initialized. Falls back
+// from io_uring to epoll and from epoll to poll when the former
+// is unavailable.
+int
+fdwatch_init(Fdwatch *fw, int backend, int max_fds)
+{
+    *fw = (Fdwatch) {
+        .backend = FDWATCH_POLL,
+        .epfd = -1,
+    };
+
+#ifdef HAVE_IO_URING
+    if (backend == FDWATCH_URING) {
+        fw->uring = uring_init();
+        if (fw->uring) {
+            fw->backend = FDWATCH_URING;
+            return fw->backend;
+        }
+        backend = FDWATCH_EPOLL;
+    }
+#else
+    if (backend == FDWATCH_URING)
+        backend = FDWATCH_EPOLL;
+#endif
+
+#ifdef HAVE_EPOLL
+    if (backend == FDWATCH_EPOLL) {
+        fw->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (fw->epfd == -1) {
+            perror("epoll_create1() inside fdwatch_init()");
+            return fw->backend;
+        }
+        fw->backend = FDWATCH_EPOLL;
+        fw->n_events = max_fds < 1024 ? max_fds : 1024;
+        fw->events = xmalloc(sizeof(struct epoll_event) * fw->n_events);
+    }
+#else
+    (void) backend;
+    (void) max_fds;
+#endif
+
+    return fw->backend;
+}
+
+#ifdef HAVE_EPOLL
+static int
+epoll_ctl_pollfd(Fdwatch *fw, int op, struct pollfd *pfd)
+{
+    struct epoll_event ev = {
+        .events =
+            ((pfd->events & POLLIN)  ? EPOLLIN  : 0) |
+            ((pfd->events & POLLOUT) ? EPOLLOUT : 0),
+        .data.fd = pfd->fd,
+    };
+    return epoll_ctl(fw->epfd, op, pfd->fd, &ev);
+}
+#endif // HAVE_EPOLL
+
+static void
+add_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i, int kind)
+{
+    set_fd_idx(fw, pfds[i].fd, i);
+
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING) {
+        Uring_Fd *f = uring_fd(fw->uring, pfds[i].fd);
+        f->watched = 1;
+        f->armed = 0;
+        f->gen++;
+        f->kind = kind;
+        if (kind == FD_KIND_LISTEN)
+            ((Uring*) fw->uring)->listen_fd = pfds[i].fd;
+        uring_queue_rearm(fw->uring, pfds[i].fd);
+        return;
+    }
+#else
+    (void) kind;
+#endif
+#ifdef HAVE_EPOLL
+    if (fw->backend == FDWATCH_EPOLL) {
+        if (epoll_ctl_pollfd(fw, EPOLL_CTL_ADD, pfds + i) == -1)
+            perror("epoll_ctl(EPOLL_CTL_ADD)");
+    }
+#endif
+}
+
+// Starts watching pfds[i].fd for pfds[i].events
+void
+fdwatch_add_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i)
+{
+    add_fd(fw, pfds, i, FD_KIND_POLL);
+}
+
+// Like fdwatch_add_fd(), for a listen socket. Take its connections
+// with fdwatch_take_accepted() if fdwatch_accepts() says so.
+void
+fdwatch_add_listen_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i)
+{
+    add_fd(fw, pfds, i, FD_KIND_LISTEN);
+}
+
+// Like fdwatch_add_fd(), for a connected socket. Use fdwatch_recv()
+// and fdwatch_sendmsg() on it.
+void
+fdwatch_add_sock_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i)
+{
+    add_fd(fw, pfds, i, FD_KIND_SOCK);
+}
+
+// Call after changing pfds[i].events
+void
+fdwatch_mod_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i)
+{
+    set_fd_idx(fw, pfds[i].fd, i);
+
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING) {
+        uring_disarm(fw->uring, pfds[i].fd);
+        uring_queue_rearm(fw->uring, pfds[i].fd);
+        return;
+    }
+#endif
+#ifdef HAVE_EPOLL
+    if (fw->backend == FDWATCH_EPOLL) {
+        if (epoll_ctl_pollfd(fw, EPOLL_CTL_MOD, pfds + i) == -1)
+            perror("epoll_ctl(EPOLL_CTL_MOD)");
+    }
+#endif
+}
+
+// Stops watching fd. Must be called before fd is closed.
+void
+fdwatch_del_fd(Fdwatch *fw, int fd)
+{
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING) {
+        Uring *u = fw->uring;
+        Uring_Fd *f = uring_fd(u, fd);
+        uring_disarm(u, fd);
+        if (f->io_armed) {
+            uint64_t op = f->kind == FD_KIND_LISTEN ?
+                URING_OP_ACCEPT : URING_OP_RECV;
+            uring_cancel(u, IORING_OP_ASYNC_CANCEL,
+                         URING_UD(op, f->conn_gen, fd));
+        }
+        if (f->has_data)
+            uring_put_buf(u, f->bid);
+
+        // A send keeps the socket open until it's done, but it has
+        // to reach the kernel while fd still refers to the socket
+        if (f->send && u->sqe_pushed != u->sqe_tail &&
+            uring_enter(u, 0, 0) < 0)
+            perror("io_uring_enter() inside fdwatch_del_fd()");
+
+        *f = (Uring_Fd) { .gen = f->gen, .conn_gen = f->conn_gen + 1 };
+        return;
+    }
+#endif
+#ifdef HAVE_EPOLL
+    if (fw->backend == FDWATCH_EPOLL) {
+        if (epoll_ctl(fw->epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+            perror("epoll_ctl(EPOLL_CTL_DEL)");
+    }
+#else
+    (void) fw; (void) fd;
+#endif
+}
+
+// Returns 1 if the backend accepts connections on the listen socket
+// by itself, see fdwatch_take_accepted()
+int
+fdwatch_accepts(Fdwatch *fw)
+{
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING) {
+        Uring *u = fw->uring;
+        return u->accept_ok || u->accepted_i < u->n_accepted;
+    }
+#endif
+    (void) fw;
+    return 0;
+}
+
+// Returns the next connection the backend accepted, or -1 if there
+// are no more
+int
+fdwatch_take_accepted(Fdwatch *fw)
+{
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING) {
+        Uring *u = fw->uring;
+        if (u->accepted_i == u->n_accepted) {
+            u->accepted_i = u->n_accepted = 0;
+            return -1;
+        }
+        return u->accepted[u->accepted_i++];
+    }
+#endif
+    (void) fw;
+    return -1;
+}
+
+// recv() for sockets added with fdwatch_add_sock_fd()
+ssize_t
+fdwatch_recv(Fdwatch *fw, int fd, void *buf, size_t len)
+{
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING) {
+        Uring_Fd *f = uring_fd(fw->uring, fd);
+        if (f->kind == FD_KIND_SOCK &&
+            (f->has_data || f->eof || f->err || f->io_armed))
+            return uring_recv(fw->uring, fd, buf, len);
+    }
+#endif
+    (void) fw;
+    return recv(fd, buf, len, 0);
+}
+
+// sendmsg() for sockets added with fdwatch_add_sock_fd(). Anything
+// else written to the socket has to wait while
+// fdwatch_send_pending() is true.
+ssize_t
+fdwatch_sendmsg(Fdwatch *fw, int fd, struct msghdr *msg, int flags)
+{
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING &&
+        uring_fd(fw->uring, fd)->kind == FD_KIND_SOCK)
+        return uring_sendmsg(fw->uring, fd, msg, flags);
+#endif
+    (void) fw;
+    return sendmsg(fd, msg, flags);
+}
+
+// Returns 1 while data given to fdwatch_sendmsg() hasn't been sent.
+// POLLOUT is reported once it has.
+int
+fdwatch_send_pending(Fdwatch *fw, int fd)
+{
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING)
+        return uring_fd(fw->uring, fd)->send != NULL;
+#endif
+    (void) fw; (void) fd;
+    return 0;
+}
+
+/*
+  Waits for events on the first n entries of pfds. Returns the
+  number of ready entries or -1 on error. fw->ready holds their
+  indices in ascending order.
+*/
+int
+fdwatch(Fdwatch *fw, struct pollfd *pfds, nfds_t n, int timeout_ms)
+{
+#ifdef HAVE_IO_URING
+    if (fw->backend == FDWATCH_URING)
+        return uring_fdwatch(fw, pfds, n, timeout_ms);
+#endif
+
+#ifdef HAVE_EPOLL
+    if (fw->backend == FDWATCH_EPOLL) {
+        clear_ready(fw, pfds, n);
+
+        struct epoll_event *evs = fw->events;
+        int nev = epoll_wait(fw->epfd, evs, fw->n_events, timeout_ms);
+        if (nev == -1) {
+            if (errno == EINTR) return 0;
+            return -1;
+        }
+
+        for (int e = 0; e < nev; e++) {
+            nfds_t i = fdwatch_get_fd_idx(fw, pfds, n, evs[e].data.fd);
+            if (i == n) continue;
+
+            pfds[i].revents =
+                ((evs[e].events & EPOLLIN)  ? POLLIN  : 0) |
+                ((evs[e].events & EPOLLOUT) ? POLLOUT : 0) |
+                ((evs[e].events & EPOLLERR) ? POLLERR : 0) |
+                ((evs[e].events & EPOLLHUP) ? POLLHUP : 0);
+            push_ready(fw, i);
+        }
+
+        qsort(fw->ready, fw->n_ready, sizeof(fw->ready[0]), cmp_nfds);
+        return fw->n_ready;
+    }
+#endif // HAVE_EPOLL
+
+    fw->n_ready = 0;
+    int nfds = poll(pfds, n, timeout_ms);
+    if (nfds == -1) {
+        if (errno == EINTR) return 0;
+        return -1;
+    }
+
+    for (nfds_t i = 0; i < n && fw->n_ready < (nfds_t) nfds; i++) {
+        if (pfds[i].revents)
+            push_ready(fw, i);
+    }
+
+    return fw->n_ready;
 }
@@ -1 +1,73 @@
+#ifndef _MIMINO_FDWATCH_H
+#define _MIMINO_FDWATCH_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#define FDWATCH_POLL  1
+#define FDWATCH_EPOLL 2
+#define FDWATCH_URING 3
+
+#define FDWATCH_DEFAULT_MAX_NFDS 10000
+
+/*
+  Watches the fds of a pollfd array. The caller owns the array
+  and keeps .events up to date through fdwatch_add_fd() and
+  fdwatch_mod_fd(). After fdwatch() returns, .revents is set for
+  the ready entries and their indices are listed in 'ready'.
+
+  The io_uring backend also accepts, receives and sends in the ring
+  for the sockets added with fdwatch_add_listen_fd() and
+  fdwatch_add_sock_fd(), so those go through the fdwatch_*() calls
+  below instead of accept(), recv() and sendmsg().
+*/
+typedef struct {
+    int backend;
+
+    // epoll backend
+    int epfd;
+    void *events;     // struct epoll_event[n_events]
+    int n_events;
+
+    // io_uring backend
+    void *uring;      // Uring, see fdwatch.c
+
+    // Maps an fd to its index in the pollfd array
+    nfds_t *fd_idx;
+    size_t n_fd_idx;
+
+    // Indices of pollfds that had events in the last fdwatch()
+    nfds_t *ready;
+    nfds_t n_ready;
+    nfds_t n_ready_alloc;
+} Fdwatch;
+
 int fdwatch_get_max_poll_nfds();
+int fdwatch_init(Fdwatch *fw, int backend, int max_fds);
+void fdwatch_add_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i);
+void fdwatch_add_listen_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i);
+void fdwatch_add_sock_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i);
+void fdwatch_mod_fd(Fdwatch *fw, struct pollfd *pfds, nfds_t i);
+void fdwatch_del_fd(Fdwatch *fw, int fd);
+nfds_t fdwatch_get_fd_idx(Fdwatch *fw, struct pollfd *pfds, nfds_t n, int fd);
+int fdwatch(Fdwatch *fw, struct pollfd *pfds, nfds_t n, int timeout_ms);
+int fdwatch_accepts(Fdwatch *fw);
+int fdwatch_take_accepted(Fdwatch *fw);
+ssize_t fdwatch_recv(Fdwatch *fw, int fd, void *buf, size_t len);
+ssize_t fdwatch_sendmsg(Fdwatch *fw, int fd, struct msghdr *msg, int flags);
+int fdwatch_send_pending(Fdwatch *fw, int fd);
+char* fdwatch_backend_name(int backend);
+int fdwatch_backend_from_name(char *name);
+
+#endif // _MIMINO_FDWATCH_H
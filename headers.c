@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include "headers.h"
+
+#define SERVER_LINE "Server: mimino\r\n"
+
+void
+header_cache_init(Header_Cache *c, int keep_alive_secs)
+{
+    c->date_time = -1;
+    c->date_len = 0;
+    c->keep_alive_len = snprintf(c->keep_alive, sizeof(c->keep_alive),
+                                 SERVER_LINE "Keep-Alive: timeout=%d\r\n",
+                                 keep_alive_secs);
+}
+
+static char*
+put_2_digits(char *p, int n)
+{
+    *p++ = '0' + n / 10;
+    *p++ = '0' + n % 10;
+    return p;
+}
+
+/*
+  Writes t as an IMF-fixdate, like "Sun, 06 Nov 1994 08:49:37 GMT",
+  and a NUL into dest, which has to hold HTTP_DATE_LEN + 1 chars.
+  The date is worked out with integer math instead of gmtime() and
+  strftime(), which take locks and look at the locale.
+*/
+char*
+format_http_date(char *dest, time_t t)
+{
+    static const char days[] = "ThuFriSatSunMonTueWed";
+    static const char months[] = "MarAprMayJunJulAugSepOctNovDecJanFeb";
+
+    long long secs = t % 86400;
+    long long z = t / 86400;
+    if (secs < 0) {
+        secs += 86400;
+        z--;
+    }
+    int weekday = ((z % 7) + 7) % 7; // 1970-01-01 was a Thursday
+
+    // Civil date from days since 1970, counting years from March
+    // so that the leap day is the last one
+    z += 719468;
+    long long era = (z >= 0 ? z : z - 146096) / 146097;
+    long long doe = z - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    int day = doy - (153 * mp + 2) / 5 + 1;
+    int year = yoe + era * 400 + (mp >= 10);
+
+    char *p = dest;
+    memcpy(p, days + 3 * weekday, 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = put_2_digits(p, day);
+    *p++ = ' ';
+    memcpy(p, months + 3 * mp, 3);
+    p += 3;
+    *p++ = ' ';
+    p = put_2_digits(p, year / 100 % 100);
+    p = put_2_digits(p, year % 100);
+    *p++ = ' ';
+    p = put_2_digits(p, secs / 3600);
+    *p++ = ':';
+    p = put_2_digits(p, secs / 60 % 60);
+    *p++ = ':';
+    p = put_2_digits(p, secs % 60);
+    memcpy(p, " GMT", 5);
+
+    return dest;
+}
+
+void
+buf_append_status_line(Buffer *b, int status)
+{
+    #define STATUS(code, line) \
+        case code: BUF_APPEND_LIT(b, "HTTP/1.1 " #code " " line "\r\n"); return
+
+    switch (status) {
+    STATUS(200, "OK");
+    STATUS(206, "Partial Content");
+    STATUS(301, "Moved Permanently");
+    STATUS(400, "Bad Request");
+    STATUS(404, "Not Found");
+    STATUS(414, "URI Too Long");
+    STATUS(416, "Range Not Satisfiable");
+    STATUS(431, "Request Header Fields Too Large");
+    STATUS(500, "Internal Server Error");
+    STATUS(501, "Not Implemented");
+    }
+    #undef STATUS
+
+    BUF_APPEND_LIT(b, "HTTP/1.1 ");
+    buf_append_num(b, status);
+    BUF_APPEND_LIT(b, " \r\n");
+}
+
+// Date, Server, and Keep-Alive or Connection: close
+void
+buf_append_common_headers(Buffer *b, Header_Cache *c, time_t now,
+                          int keep_alive)
+{
+    if (c->date_time != now) {
+        memcpy(c->date_line, "Date: ", 6);
+        format_http_date(c->date_line + 6, now);
+        memcpy(c->date_line + 6 + HTTP_DATE_LEN, "\r\n", 2);
+        c->date_len = 6 + HTTP_DATE_LEN + 2;
+        c->date_time = now;
+    }
+    buf_append(b, c->date_line, c->date_len);
+
+    if (keep_alive)
+        buf_append(b, c->keep_alive, c->keep_alive_len);
+    else
+        BUF_APPEND_LIT(b, SERVER_LINE "Connection: close\r\n");
+}
+
+// name includes the ": "
+void
+buf_append_header_num(Buffer *b, char *name, long long n)
+{
+    buf_append_str(b, name);
+    buf_append_num(b, n);
+    BUF_APPEND_LIT(b, "\r\n");
+}
+
+void
+buf_append_header_date(Buffer *b, char *name, time_t t)
+{
+    char date[HTTP_DATE_LEN + 1];
+    buf_append_str(b, name);
+    buf_append(b, format_http_date(date, t), HTTP_DATE_LEN);
+    BUF_APPEND_LIT(b, "\r\n");
+}
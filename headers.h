@@ -0,0 +1,32 @@
+#ifndef _MIMINO_HEADERS_H
+#define _MIMINO_HEADERS_H
+
+#include <time.h>
+#include "buffer.h"
+
+#define HTTP_DATE_LEN 29 // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+/*
+  Prebuilt pieces of response heads, so that writing a head takes a
+  few memcpy()s instead of printf()s. The Date line is rebuilt at
+  most once a second, the rest once at startup. Each server has its
+  own, so threaded workers don't share it.
+*/
+typedef struct {
+    time_t date_time; // the second date_line is for
+    char date_line[sizeof("Date: \r\n") + HTTP_DATE_LEN];
+    size_t date_len;
+    char keep_alive[64]; // Server and Keep-Alive lines
+    size_t keep_alive_len;
+} Header_Cache;
+
+void header_cache_init(Header_Cache *c, int keep_alive_secs);
+char* format_http_date(char *dest, time_t t);
+
+void buf_append_status_line(Buffer *b, int status);
+void buf_append_common_headers(Buffer *b, Header_Cache *c, time_t now,
+                               int keep_alive);
+void buf_append_header_num(Buffer *b, char *name, long long n);
+void buf_append_header_date(Buffer *b, char *name, time_t t);
+
+#endif // _MIMINO_HEADERS_H
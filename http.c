@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,54 +9,60 @@
 #include "xmalloc.h"
 #include "buffer.h"
 #include "defer.h"
+#include "scan.h"
+#include "headers.h"
 
-#define DATE_LEN 30
-char*
-to_rfc1123_date(char *dest, time_t tm) {
-    time_t t = tm;
-    if (strftime(dest, DATE_LEN,
-                 "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t)) == 0) {
-        fprintf(stderr, "strftime() failed, aborting!\n");
-        exit(1);
-    }
-    return dest;
+// Status line and the headers every response has
+static void
+start_head(Server *serv, Buffer *head, int status, int keep_alive)
+{
+    buf_append_status_line(head, status);
+    buf_append_common_headers(head, &serv->headers, serv->time_now,
+                              keep_alive);
 }
 
 int
 is_valid_http_path_char(char c)
 {
-    if (is_alpha(c) || is_digit(c))
-        return 1;
-
-    return strchr("!$?&'()*+,;=%-._~:@/", (int) c) != NULL;
+    return scan_char_class[(unsigned char) c] & SCAN_PATH_CHAR;
 }
 
 int
-can_handle_http_ver(char *ver)
+can_handle_http_ver(char *ver, size_t len)
 {
-    return !strcmp("0.9", ver) || !strcmp("1.0", ver) || !strcmp("1.1", ver);
+    return len == 3 &&
+        (!strncmp("0.9", ver, 3) ||
+         !strncmp("1.0", ver, 3) ||
+         !strncmp("1.1", ver, 3));
 }
 
-// Return 1 if buf has \r\n\r\n at the end
-// Return 0 otherwise
-int
-is_http_end(char *buf, size_t size)
+// Returns the start of the slice inside req->buf. It's not null
+// terminated, use s.len.
+char*
+req_slice(Http_Request *req, Http_Slice s)
 {
-    size_t i = size - 1; // Last char index
-
-    // TODO: check for "\n\n" as well
+    return req->buf->data + s.offset;
+}
 
-    if (size < 4) return 0;
+// Returns 1 if the slice is the string str
+int
+req_slice_eq(Http_Request *req, Http_Slice s, char *str)
+{
+    return strlen(str) == s.len && !memcmp(req_slice(req, s), str, s.len);
+}
 
-    // Ignore trailing null
-    if (buf[i] == '\0') {
-        if (size < 5) return 0;
-        i--;
-    }
+// Same as req_slice_eq() but ignores case
+int
+req_slice_case_eq(Http_Request *req, Http_Slice s, char *str)
+{
+    return strlen(str) == s.len && !strncasecmp(req_slice(req, s), str, s.len);
+}
 
-    return
-        buf[i-3] == '\r' && buf[i-2] == '\n' &&
-        buf[i-1] == '\r' && buf[i] == '\n';
+// Returns a null terminated copy of the slice to be freed
+char*
+req_slice_dup(Http_Request *req, Http_Slice s)
+{
+    return xstrndup(req_slice(req, s), s.len);
 }
 
 // Return a ^ b.
@@ -100,222 +107,526 @@ consume_next_num(char **str, char *end)
     return num;
 }
 
+// Like consume_next_num(), but stops growing instead of overflowing.
+// Anything that big is past the end of any file anyway.
+static off_t
+consume_range_num(char **str, char *end)
+{
+    off_t num = 0;
+    for (; *str < end && is_digit(**str); (*str)++) {
+        if (!(num >> 58))
+            num = num * 10 + (**str - '0');
+    }
+    return num;
+}
+
+/*
+  Parses "bytes=" followed by a comma separated list of ranges into
+  ranges, as given. Returns how many there are, or 0 if the header
+  is malformed or lists more than RANGES_MAX ranges, in which case
+  it's ignored and the whole file is sent.
+*/
 int
-parse_range_header(
-    char *str,
-    size_t len,
-    int* range_start_given,
-    off_t* range_start,
-    int* range_end_given,
-    off_t* range_end)
+parse_range_header(char *str, size_t len, Http_Range *ranges)
 {
     char *end = str + len;
+    int n = 0;
 
-    // Advance str by n bytes; Return if running over buffer
-    #define SAFE_ADVANCE(str, n) {  \
-        if (((str) + (n)) >= end) { \
-            return 0;               \
-        }                           \
-        (str) += (n);               \
+    if (len < 6 || strncasecmp(str, "bytes=", 6))
+        return 0;
+    str += 6;
+
+    while (1) {
+        Http_Range r = { -1, -1 };
+
+        while (str < end && (*str == ' ' || *str == '\t')) str++;
+        if (str < end && is_digit(*str))
+            r.first = consume_range_num(&str, end);
+        if (str == end || *str != '-')
+            return 0;
+        str++;
+        if (str < end && is_digit(*str))
+            r.last = consume_range_num(&str, end);
+
+        // Neither bound, or an inverted range
+        if (r.first == -1 && r.last == -1)
+            return 0;
+        if (r.first != -1 && r.last != -1 && r.last < r.first)
+            return 0;
+
+        if (n == RANGES_MAX)
+            return 0;
+        ranges[n++] = r;
+
+        while (str < end && (*str == ' ' || *str == '\t')) str++;
+        if (str == end)
+            return n;
+        if (*str != ',')
+            return 0;
+        str++;
     }
+}
 
-    if (strncmp(str, "bytes=", 6)) {
-        return 0;
+// Ranges closer than this are sent as one, the gap costs less than
+// the part head in between
+#define RANGES_GAP_MERGE 80
+
+/*
+  Turns the n ranges of a Range header into offsets in a body of
+  size bytes, in place. Suffix ranges are counted back from the end,
+  open or overlong ones stop at the end, and ranges starting past it
+  are dropped. What's left is sorted, and ranges that overlap or
+  nearly touch are merged. Returns the number of ranges left, 0 if
+  none is satisfiable.
+*/
+int
+resolve_ranges(Http_Range *ranges, int n, off_t size)
+{
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        Http_Range r = ranges[i];
+        if (r.first == -1) {
+            if (r.last == 0 || size == 0) continue;
+            r.first = MAX(size - r.last, 0);
+            r.last = size - 1;
+        } else {
+            if (r.first >= size) continue;
+            if (r.last == -1 || r.last >= size) r.last = size - 1;
+        }
+        ranges[k++] = r;
     }
-    SAFE_ADVANCE(str, 6);
 
-    // Range start
-    if (is_digit(*str)) {
-        *range_start_given = 1;
-        *range_start = (off_t) consume_next_num(&str, end);
+    // Insertion sort, there are a handful of them
+    for (int i = 1; i < k; i++) {
+        Http_Range r = ranges[i];
+        int j = i;
+        for (; j > 0 && ranges[j-1].first > r.first; j--)
+            ranges[j] = ranges[j-1];
+        ranges[j] = r;
     }
 
-    // The dash between the ranges
-    if (*str != '-') {
-        *range_start_given = 0;
-        return 0;
+    int m = 0;
+    for (int i = 0; i < k; i++) {
+        if (m > 0 && ranges[i].first <= ranges[m-1].last + RANGES_GAP_MERGE)
+            ranges[m-1].last = MAX(ranges[m-1].last, ranges[i].last);
+        else
+            ranges[m++] = ranges[i];
     }
-    SAFE_ADVANCE(str, 1);
+    return m;
+}
+
+typedef struct {
+    char *name;
+    size_t len;
+    Header_Handler handle;
+} Header_Def;
+
+static void on_host(Http_Request *req, Http_Slice v) { req->host = v; }
+static void on_user_agent(Http_Request *req, Http_Slice v) { req->user_agent = v; }
+static void on_accept(Http_Request *req, Http_Slice v) { req->accept = v; }
+static void on_connection(Http_Request *req, Http_Slice v) { req->connection = v; }
 
-    // Range end
-    if (is_digit(*str)) {
-        *range_end_given = 1;
-        *range_end = (off_t) consume_next_num(&str, end);
+static void
+on_content_length(Http_Request *req, Http_Slice v)
+{
+    char *p = req_slice(req, v);
+    off_t n = 0;
+
+    if (v.len == 0 || v.len > 18) {
+        req->error = "Invalid Content-Length";
+        req->error_status = 400;
+        return;
+    }
+    for (size_t i = 0; i < v.len; i++) {
+        if (!is_digit(p[i])) {
+            req->error = "Invalid Content-Length";
+            req->error_status = 400;
+            return;
+        }
+        n = n * 10 + (p[i] - '0');
     }
 
-    // Neither of the ranges were given
-    if (!range_start_given && !range_end_given) {
-        *range_start = 0;
-        *range_end = 0;
-        return 0;
+    // Repeating it is fine, disagreeing isn't
+    if (req->content_length_given && req->content_length != n) {
+        req->error = "Conflicting Content-Length";
+        req->error_status = 400;
+        return;
     }
+    req->content_length_given = 1;
+    req->content_length = n;
+}
 
-    return 1;
-    #undef SAFE_ADVANCE
+// Only chunked can be framed, and it has to be the last coding
+static void
+on_transfer_encoding(Http_Request *req, Http_Slice v)
+{
+    char *p = req_slice(req, v);
+    size_t len = v.len;
+
+    while (len > 0 && p[len-1] == ' ')
+        len--;
+    if (len < 7 || strncasecmp(p + len - 7, "chunked", 7) ||
+        (len > 7 && p[len-8] != ' ' && p[len-8] != ',')) {
+        req->error = "Unsupported Transfer-Encoding";
+        req->error_status = 501;
+        return;
+    }
+    req->chunked = 1;
 }
 
-// Parses buffer and fills out Http_Request fields
-Http_Request*
-parse_http_request(Http_Request *req)
+static void
+on_range(Http_Request *req, Http_Slice v)
 {
-    // Last char
-    char *end = req->buf->data + req->buf->n_items;
+    req->n_ranges = parse_range_header(req_slice(req, v), v.len, req->ranges);
+}
 
-    // Advance str by n bytes; Return if running over buffer
-    #define SAFE_ADVANCE(str, n) {         \
-        if (((str) + (n)) >= end) {        \
-            req->error = "Unexpected EOF"; \
-            return req;                    \
-        }                                  \
-        (str) += (n);                      \
-    }
+/*
+  Handled headers are looked up with a perfect hash of the name's
+  length and its case folded first and last chars, then one compare.
+  HEADER_HASH() is a constant expression, so the table is laid out
+  at compile time and a collision shows up as an -Woverride-init
+  warning. It's also collision free with If-None-Match,
+  If-Modified-Since, If-Range and Accept-Encoding, so those can be
+  added as they are.
+*/
+#define HEADER_SLOTS 16
+#define HEADER_HASH(len, first, last) \
+    ((4 * (len) + ((first) | 0x20) + ((last) | 0x20)) & (HEADER_SLOTS - 1))
+#define HEADER(name, first, last, handler) \
+    [HEADER_HASH(sizeof(name) - 1, first, last)] = \
+        { name, sizeof(name) - 1, handler }
+
+static const Header_Def header_defs[HEADER_SLOTS] = {
+    HEADER("host",       'h', 't', on_host),
+    HEADER("user-agent", 'u', 't', on_user_agent),
+    HEADER("accept",     'a', 't', on_accept),
+    HEADER("connection", 'c', 'n', on_connection),
+    HEADER("range",      'r', 'e', on_range),
+    HEADER("content-length",    'c', 'h', on_content_length),
+    HEADER("transfer-encoding", 't', 'g', on_transfer_encoding),
+};
+
+#undef HEADER
+
+// Returns the handler of the header or NULL if it isn't handled
+Header_Handler
+get_header_handler(char *name, size_t len)
+{
+    if (len == 0) return NULL;
 
-    // Left (l) and right (r) boundaries of a token
-    char *l = req->buf->data;
-    char *r = req->buf->data;
+    const Header_Def *d = header_defs + HEADER_HASH(len, name[0], name[len-1]);
+    if (d->len != len || strncasecmp(d->name, name, len))
+        return NULL;
+
+    return d->handle;
+}
+
+// Slice of the request buffer from l up to r
+#define SLICE(l, r) ((Http_Slice) { \
+    .offset = (size_t) ((l) - req->buf->data), \
+    .len = (size_t) ((r) - (l)), \
+})
+
+// Parses "METHOD PATH HTTP/x.y" in [p, end), end being the CR of the
+// line's CRLF. Returns NULL or the error.
+static char*
+parse_request_line(Http_Request *req, char *p, char *end)
+{
+    // Left (l) boundary of a token
+    char *l = p;
 
     // Parse method
-    while (is_upper_ascii(*r))
-        SAFE_ADVANCE(r, 1);
-    if (l == r) {
-        req->error = "Invalid HTTP method";
-        return req;
-    }
-    req->method = xstrndup(l, (size_t) (r - l));
+    while (p < end && is_upper_ascii(*p))
+        p++;
+    if (l == p)
+        return "Invalid HTTP method";
+    req->method = SLICE(l, p);
 
     // Space
-    if (*r != ' ') {
-        req->error = "No space after HTTP method";
-        return req;
-    }
-    SAFE_ADVANCE(r, 1);
+    if (p == end || *p != ' ')
+        return "No space after HTTP method";
+    p++;
 
     // Parse path
-    l = r;
-    while (is_valid_http_path_char(*r))
-        SAFE_ADVANCE(r, 1);
-    if (l == r) {
-        req->error = "Invalid path";
-        return req;
-    }
-    req->path = xstrndup(l, (size_t) (r - l));
+    l = p;
+    p = scan_path(p, end);
+    if (l == p)
+        return "Invalid path";
+    req->path = SLICE(l, p);
 
     // Space
-    if (*r != ' ') {
-        req->error = "No space after path";
-        return req;
-    }
-    SAFE_ADVANCE(r, 1);
+    if (p == end || *p != ' ')
+        return "No space after path";
+    p++;
 
     // Parse 'HTTP' part of the HTTP version
-    if (strncmp(r, "HTTP", 4)) {
-        req->error = "No 'HTTP' in HTTP version";
-        return req;
-    }
-    SAFE_ADVANCE(r, 4);
+    if (end - p < 4 || strncmp(p, "HTTP", 4))
+        return "No 'HTTP' in HTTP version";
+    p += 4;
 
     // Slash after 'HTTP'
-    if (*r != '/') {
-        req->error = "No '/' in HTTP version";
-        return req;
-    }
-    SAFE_ADVANCE(r, 1);
+    if (p == end || *p != '/')
+        return "No '/' in HTTP version";
+    p++;
 
     // Version number '[0-9]+\.[0-9]+'
-    l = r;
-    while (is_digit(*r))
-        SAFE_ADVANCE(r, 1);
-    if (*r != '.') {
-        req->error = "No '.' in HTTP version number";
-        return req;
-    }
-    SAFE_ADVANCE(r, 1);
-    while (is_digit(*r))
-        SAFE_ADVANCE(r, 1);
-    req->version_number = xstrndup(l, (size_t) (r - l));
-    if(!can_handle_http_ver(req->version_number)) {
-        req->error = "Can't handle given version";
-        return req;
-    }
+    l = p;
+    while (p < end && is_digit(*p))
+        p++;
+    if (p == end || *p != '.')
+        return "No '.' in HTTP version number";
+    p++;
+    while (p < end && is_digit(*p))
+        p++;
+    req->version_number = SLICE(l, p);
+    if (!can_handle_http_ver(l, (size_t) (p - l)))
+        return "Can't handle given version";
 
     // \r\n at the end
-    if (*r != '\r' || *(r + 1) != '\n') {
-        req->error = "No CRLF after HTTP version";
-        return req;
-    }
-    SAFE_ADVANCE(r, 2);
+    if (p != end)
+        return "No CRLF after HTTP version";
 
-    // Parse headers
-    while (1) {
-        char *hn; // header name
-        size_t hn_len;
-        char *hv; // header value
-        size_t hv_len;
-
-        // Final \r\n
-        if (*r == '\r' && *(r + 1) == '\n') {
-            return req;
+    return NULL;
+}
+
+#define BODY_DATA         0 // body_left bytes of data
+#define BODY_DATA_CR      1 // CRLF after chunk data
+#define BODY_DATA_LF      2
+#define BODY_SIZE_START   3 // chunk size, at least one hex digit
+#define BODY_SIZE         4
+#define BODY_EXT          5 // chunk extensions, ignored
+#define BODY_SIZE_LF      6
+#define BODY_TRAILER      7 // start of a trailer line or the final CRLF
+#define BODY_TRAILER_LINE 8
+#define BODY_FINAL_LF     9
+
+static int
+hex_value(char c)
+{
+    if (is_digit(c)) return c - '0';
+    return (c | 0x20) - 'a' + 10;
+}
+
+/*
+  Consumes the request body, with Content-Length or chunked framing,
+  as it arrives after the head. Nothing here uses bodies, so they're
+  dropped. Consumed bytes are cut out of the buffer right away, so a
+  body of any size streams through it, and whatever follows the body
+  ends up right after the head for the next pipelined request.
+  Returns P_* like parse_http_request().
+*/
+static int
+parse_http_body(Http_Request *req)
+{
+    Buffer *buf = req->buf;
+    char *start = buf->data + req->head_len;
+    char *end = buf->data + buf->n_items;
+    char *p = start;
+
+    while (p < end && req->parse_state == PARSE_BODY && !req->error) {
+        if (req->body_state == BODY_DATA) {
+            off_t n = MIN(end - p, req->body_left);
+            p += n;
+            req->body_left -= n;
+            if (req->body_left > 0)
+                break;
+
+            if (req->chunked) req->body_state = BODY_DATA_CR;
+            else req->parse_state = PARSE_DONE;
+            continue;
         }
 
-        // Header name
-        hn = r;
-        while (is_alpha(*r) || *r == '-')
-            SAFE_ADVANCE(r, 1);
-        hn_len = (size_t) (r - hn);
+        char c = *p++;
+        switch (req->body_state) {
+        case BODY_DATA_CR:
+            if (c != '\r') req->error = "No CRLF after chunk data";
+            req->body_state = BODY_DATA_LF;
+            break;
+
+        case BODY_DATA_LF:
+            if (c != '\n') req->error = "No CRLF after chunk data";
+            req->body_state = BODY_SIZE_START;
+            break;
+
+        case BODY_SIZE_START:
+        case BODY_SIZE:
+            if (is_hex(c)) {
+                // Chunks of 2^60 bytes are plenty
+                if (req->body_left >> 56) {
+                    req->error = "Chunk size too big";
+                    break;
+                }
+                req->body_left = req->body_left * 16 + hex_value(c);
+                req->body_state = BODY_SIZE;
+            } else if (req->body_state == BODY_SIZE_START) {
+                req->error = "Invalid chunk size";
+            } else if (c == '\r') {
+                req->body_state = BODY_SIZE_LF;
+            } else {
+                req->body_state = BODY_EXT;
+            }
+            break;
+
+        case BODY_EXT:
+            if (c == '\r') req->body_state = BODY_SIZE_LF;
+            break;
+
+        case BODY_SIZE_LF:
+            if (c != '\n') req->error = "No CRLF after chunk size";
+
+            // The last chunk has size 0
+            req->body_state = req->body_left > 0 ? BODY_DATA : BODY_TRAILER;
+            break;
+
+        case BODY_TRAILER:
+            req->body_state = c == '\r' ? BODY_FINAL_LF : BODY_TRAILER_LINE;
+            break;
+
+        case BODY_TRAILER_LINE:
+            if (c == '\n') req->body_state = BODY_TRAILER;
+            break;
+
+        case BODY_FINAL_LF:
+            if (c != '\n') req->error = "No CRLF after the last chunk";
+            req->parse_state = PARSE_DONE;
+            break;
+        }
+    }
+
+    // Cut out what was consumed
+    memmove(start, p, (size_t) (end - p));
+    buf->n_items -= (size_t) (p - start);
+
+    if (req->error) {
+        req->error_status = 400;
+        return P_ERROR;
+    }
+    return req->parse_state == PARSE_DONE ? P_COMPLETE : P_PARTIAL;
+}
+
+// Parses "Name: value" in [p, end), end being the CR of the line's
+// CRLF. Returns NULL or the error.
+static char*
+parse_header_line(Http_Request *req, char *p, char *end)
+{
+    // Header name
+    char *hn = p;
+    p = scan_header_name(p, end);
+    size_t hn_len = (size_t) (p - hn);
+
+    if (p == end || *p != ':')
+        return "No ':' after header name";
+    p++;
+
+    if (p == end || *p != ' ')
+        return "No space after header name colon";
+    p++;
+
+    // Header value is the rest of the line. Unknown headers are
+    // skipped, handlers can fail by setting req->error.
+    Header_Handler handle = get_header_handler(hn, hn_len);
+    if (handle)
+        handle(req, SLICE(p, end));
+
+    return req->error;
+}
+
+#undef SLICE
+
+/*
+  Parses the request in req->buf as it arrives. Call it after
+  every read: it picks up where it left off, so each byte is only
+  looked at once however the request is split into reads. Lines are
+  parsed once their LF arrives.
+
+  Returns P_PARTIAL until the empty line ending the head is parsed
+  and the body, if any, is consumed by parse_http_body(). Then it
+  returns P_COMPLETE, with req->head_len set to the length of the
+  head, and anything in the buffer after that belongs to the next
+  request. Returns P_ERROR with req->error set on a bad request, the
+  fields parsed before the error are kept.
+*/
+int
+parse_http_request(Http_Request *req)
+{
+    if (req->error)
+        return P_ERROR;
+    if (req->parse_state == PARSE_DONE)
+        return P_COMPLETE;
+    if (req->parse_state == PARSE_BODY)
+        return parse_http_body(req);
+
+    char *data = req->buf->data;
+    char *end = data + req->buf->n_items;
 
-        if (*r != ':') {
-            req->error = "No ':' after header name";
-            return req;
+    while (1) {
+        char *line = data + req->parse_pos;
+        char *lf = scan_for(data + req->scan_pos, end, '\n', '\n');
+        if (lf == end) {
+            req->scan_pos = req->buf->n_items;
+            return P_PARTIAL;
         }
-        SAFE_ADVANCE(r, 1);
+        req->parse_pos = req->scan_pos = (size_t) (lf + 1 - data);
 
-        if (*r != ' ') {
-            req->error = "No space after header name colon";
-            return req;
+        if (lf == line || lf[-1] != '\r') {
+            req->error = "No CRLF at the end of the line";
+            return P_ERROR;
         }
-        SAFE_ADVANCE(r, 1);
+        char *cr = lf - 1;
+
+        if (req->parse_state == PARSE_REQUEST_LINE) {
+            // Empty lines before the request line are ignored
+            if (cr == line)
+                continue;
 
-        // Header value
-        for(hv = r; !(*r == '\r' && *(r+1) == '\n');) {
-            if (*r == '\0') {
-                req->error = "No CRLF at the end of the request";
-                return req;
+            req->error = parse_request_line(req, line, cr);
+            req->parse_state = PARSE_HEADERS;
+        } else if (cr == line) {
+            // Final \r\n, chunked wins over Content-Length. Either
+            // could be a smuggling attempt when both are given, and
+            // HTTP/1.0 peers don't know chunked, so the connection
+            // isn't reused after those.
+            req->head_len = req->parse_pos;
+            req->parse_state = PARSE_DONE;
+            if (req->chunked &&
+                (req->content_length_given ||
+                 strncmp(req_slice(req, req->version_number), "1.1", 3)))
+                req->must_close = 1;
+            if (req->chunked) {
+                req->parse_state = PARSE_BODY;
+                req->body_state = BODY_SIZE_START;
+            } else if (req->content_length > 0) {
+                req->parse_state = PARSE_BODY;
+                req->body_state = BODY_DATA;
+                req->body_left = req->content_length;
             }
-            SAFE_ADVANCE(r, 1);
-        }
-        hv_len = (size_t) (r - hv);
-
-        // Step over \r\n
-        SAFE_ADVANCE(r, 2);
-
-        // Dump header
-        /* for (size_t i = 0; i < hn_len; i++) */
-        /*     fputc(hn[i], stdout); */
-        /* fprintf(stdout, ": "); */
-        /* for (size_t i = 0; i < hv_len; i++) */
-        /*     fputc(hv[i], stdout); */
-        /* fputc('\n', stdout); */
-
-        // Check if we handle header
-        if (!strncasecmp("Host:", hn, hn_len + 1)) {
-            req->host = xstrndup(hv, hv_len);
-        } else if (!strncasecmp("User-Agent:", hn, hn_len + 1)) {
-            req->user_agent = xstrndup(hv, hv_len);
-        } else if (!strncasecmp("Accept:", hn, hn_len + 1)) {
-            req->accept = xstrndup(hv, hv_len);
-        } else if (!strncasecmp("Connection:", hn, hn_len + 1)) {
-            req->connection = xstrndup(hv, hv_len);
-        } else if (!strncasecmp("Range:", hn, hn_len + 1)) {
-            parse_range_header(hv, hv_len,
-                               &req->range_start_given,
-                               &req->range_start,
-                               &req->range_end_given,
-                               &req->range_end);
+            if (req->parse_state == PARSE_BODY)
+                return parse_http_body(req);
+            return P_COMPLETE;
+        } else {
+            req->error = parse_header_line(req, line, cr);
         }
+
+        if (req->error)
+            return P_ERROR;
     }
+}
 
-    return req;
-    #undef SAFE_ADVANCE
+// Empties the request so the next one on the connection can be read
+// into it, keeping its buffer. Bytes after a parsed head belong to
+// pipelined requests and are moved to the front for the parser.
+void
+reset_http_request(Http_Request *req)
+{
+    Buffer *buf = req->buf;
+    size_t used = req->parse_state == PARSE_DONE ?
+        req->head_len : buf->n_items;
+
+    memmove(buf->data, buf->data + used, buf->n_items - used);
+    buf->n_items -= used;
+
+    memset(req, 0, sizeof(*req));
+    req->buf = buf;
 }
 
 void
@@ -323,12 +634,6 @@ free_http_request(Http_Request *req)
 {
     if (!req) return;
 
-    free(req->method);
-    free(req->path);
-    free(req->version_number);
-    free(req->host);
-    free(req->user_agent);
-    free(req->accept);
     free_buf(req->buf);
 
     // NOTE: DO NOT free req->error as it's static
@@ -345,30 +650,28 @@ print_http_request(FILE *f, Http_Request *req)
     }
 
     fprintf(f, "(Http_Request) {\n");
-    fprintf(f, "  .method = \"%s\",\n", req->method);
-    fprintf(f, "  .path = \"%s\",\n", req->path);
-    fprintf(f, "  .version_number = \"%s\",\n", req->version_number);
-    fprintf(f, "  .host = \"%s\",\n", req->host);
-    fprintf(f, "  .user_agent = \"%s\",\n", req->user_agent);
-    fprintf(f, "  .accept = \"%s\",\n", req->accept);
+    #define PRINT_SLICE(name) \
+        fprintf(f, "  ." #name " = \"%.*s\",\n", \
+                (int) req->name.len, req_slice(req, req->name))
+    PRINT_SLICE(method);
+    PRINT_SLICE(path);
+    PRINT_SLICE(version_number);
+    PRINT_SLICE(host);
+    PRINT_SLICE(user_agent);
+    PRINT_SLICE(accept);
+    PRINT_SLICE(connection);
+    #undef PRINT_SLICE
     fprintf(f, "  .error = \"%s\",\n", req->error);
-    fprintf(f, "  .range_start_given = %d,\n", req->range_start_given);
-    fprintf(f, "  .range_start = %zu,\n", req->range_start);
-    fprintf(f, "  .range_end_given = %d,\n", req->range_end_given);
-    fprintf(f, "  .range_end = %zu,\n", req->range_end);
+    fprintf(f, "  .ranges = {");
+    for (int i = 0; i < req->n_ranges; i++) {
+        fprintf(f, " %lld-%lld,",
+                (long long) req->ranges[i].first,
+                (long long) req->ranges[i].last);
+    }
+    fprintf(f, " },\n");
     fprintf(f, "}\n");
 }
 
-int
-are_ranges_satisfiable(Http_Request* req, off_t max_range)
-{
-    return
-        (req->range_start_given && (req->range_start > max_range)) ||
-        (req->range_end_given && (req->range_end > max_range))     ||
-        (req->range_start_given && req->range_end_given &&
-         (req->range_start < req->range_end));
-}
-
 void
 file_list_to_html(Buffer *buf, char *endpoint, File_List *fl)
 {
@@ -429,63 +732,216 @@ file_list_to_html(Buffer *buf, char *endpoint, File_List *fl)
 // 'http_path' is the requested path extracted from the GET request.
 void
 write_dirlisting_http(
+    Server *serv,
     Buffer *head,
     Buffer *body,
     char *dir,
-    char *http_path)
+    char *http_path,
+    int keep_alive)
 {
     // Get file list
     File_List *fl = ls(dir);
     if (!fl) {
         // Internal error
-        buf_append_str(head, "HTTP/1.1 500\r\n");
+        start_head(serv, head, 500, keep_alive);
+        BUF_APPEND_LIT(head, "Content-Length: 0\r\n\r\n");
         return;
     }
 
-    // TODO: append headers using a function which can be used
-    // both here and in make_http_response()
-
     file_list_to_html(body, http_path, fl);
 
-    char date_buf[DATE_LEN];
-    to_rfc1123_date(date_buf, fl->dir_info->last_mod);
-
-    buf_sprintf(
-        head,
-        "HTTP/1.1 200\r\n"
-        "Content-Type: text/html; charset=UTF-8\r\n"
-        "Content-Length: %zu\r\n"
-        "Last-Modified: %s\r\n\r\n",
-        body->n_items,
-        date_buf);
+    start_head(serv, head, 200, keep_alive);
+    BUF_APPEND_LIT(head, "Content-Type: text/html; charset=UTF-8\r\n");
+    buf_append_header_num(head, "Content-Length: ", body->n_items);
+    buf_append_header_date(head, "Last-Modified: ", fl->dir_info->last_mod);
+    BUF_APPEND_LIT(head, "\r\n");
 
     free_file_list(fl);
     return;
 }
 
-Http_Response*
-make_http_response(Server *serv, Http_Request *req)
+static void
+out_push(Http_Response *res, Out_Seg seg)
 {
-    Defer_Queue dq = NULL_DEFER_QUEUE;
+    if (seg.len == 0) return;
+    res->segs[res->n_segs++] = seg;
+}
+
+static void
+out_push_mem(Http_Response *res, char *data, size_t len)
+{
+    out_push(res, (Out_Seg) {
+        .type = OUT_SEG_MEM,
+        .data = data,
+        .len = len,
+    });
+}
+
+static void
+out_push_file(Http_Response *res, off_t offset, size_t len)
+{
+    out_push(res, (Out_Seg) {
+        .type = OUT_SEG_FILE,
+        .offset = offset,
+        .len = len,
+    });
+}
+
+// Fills the output queue with the head and, unless it's a HEAD
+// request, the body or the ranges of the file that are sent. Parts
+// of a multipart/byteranges response go out as their part head from
+// res->parts, then the range straight from the file.
+static void
+queue_http_response(Http_Response *res, int is_head_request)
+{
+    out_push_mem(res, res->head.data, res->head.n_items);
+
+    if (is_head_request) return;
+
+    if (res->body.data) {
+        out_push_mem(res, res->body.data, res->body.n_items);
+        return;
+    }
+    if (res->file.fd == -1) return;
 
+    if (res->n_ranges == 0) {
+        out_push_file(res, 0, res->file.size);
+        return;
+    }
+
+    if (res->n_ranges == 1) {
+        Http_Range *r = res->ranges;
+        out_push_file(res, r->first, r->last + 1 - r->first);
+        return;
+    }
+
+    size_t start = 0;
+    for (int i = 0; i < res->n_ranges; i++) {
+        Http_Range *r = res->ranges + i;
+        out_push_mem(res, res->parts.data + start, res->part_ends[i] - start);
+        out_push_file(res, r->first, r->last + 1 - r->first);
+        start = res->part_ends[i];
+    }
+
+    // Closing boundary
+    out_push_mem(res, res->parts.data + start, res->parts.n_items - start);
+}
+
+static char*
+get_content_type(char *file_name)
+{
+    static const struct { char *ext; char *type; } types[] = {
+        { ".html", "text/html; charset=UTF-8" },
+        { ".jpg",  "image/jpeg" },
+        { ".pdf",  "application/pdf" },
+        { ".css",  "text/css" },
+        { ".txt",  "text/plain; charset=UTF-8" },
+        { ".mp4",  "video/mp4" },
+    };
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strstr(file_name, types[i].ext))
+            return types[i].type;
+    }
+    return "application/octet-stream; charset=UTF-8";
+}
+
+// xorshift64*. Every worker has a state of its own, seeded in
+// run_server(), so they don't contend for random()'s lock.
+static uint64_t
+next_random(Server *serv)
+{
+    uint64_t x = serv->rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    serv->rand_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Writes a Content-Range line for r of a body of size bytes
+static void
+buf_append_content_range(Buffer *b, Http_Range *r, off_t size)
+{
+    BUF_APPEND_LIT(b, "Content-Range: bytes ");
+    buf_append_num(b, r->first);
+    buf_push(b, '-');
+    buf_append_num(b, r->last);
+    buf_push(b, '/');
+    buf_append_num(b, size);
+    BUF_APPEND_LIT(b, "\r\n");
+}
+
+/*
+  Writes the part heads and the closing boundary of a multipart/
+  byteranges response into res->parts, and where each part head ends
+  into res->part_ends. Returns the length of the whole body, for
+  Content-Length.
+*/
+static off_t
+write_byteranges_parts(Http_Response *res, char *boundary, char *type)
+{
+    init_buf(&res->parts, 128 * (res->n_ranges + 1));
+
+    off_t len = 0;
+    for (int i = 0; i < res->n_ranges; i++) {
+        Http_Range *r = res->ranges + i;
+        BUF_APPEND_LIT(&res->parts, "\r\n--");
+        buf_append_str(&res->parts, boundary);
+        BUF_APPEND_LIT(&res->parts, "\r\nContent-Type: ");
+        buf_append_str(&res->parts, type);
+        BUF_APPEND_LIT(&res->parts, "\r\n");
+        buf_append_content_range(&res->parts, r, res->file.size);
+        BUF_APPEND_LIT(&res->parts, "\r\n");
+        res->part_ends[i] = res->parts.n_items;
+        len += r->last + 1 - r->first;
+    }
+    BUF_APPEND_LIT(&res->parts, "\r\n--");
+    buf_append_str(&res->parts, boundary);
+    BUF_APPEND_LIT(&res->parts, "--\r\n");
+
+    return len + (off_t) res->parts.n_items;
+}
+
+static Http_Response*
+new_http_response()
+{
     Http_Response *res = xmalloc(sizeof(Http_Response));
     init_buf(&res->head, RESPONSE_HEADERS_BUF_INIT_SIZE);
-    res->head_nbytes_sent = 0;
-
-    int is_head_request = !strcmp(req->method, "HEAD");
     res->body.data = NULL;
-    res->body_nbytes_sent = 0;
 
     res->file = NULL_FILE;
-    res->file_offset = 0;
-    res->file_nbytes_sent = 0;
     res->file_path = NULL;
+    res->n_ranges = 0;
+    res->parts = (Buffer) {0};
+    res->n_segs = 0;
+    res->seg_i = 0;
+    res->nbytes_sent = 0;
+    res->no_sendfile = 0;
+    res->fcache_entry = NULL;
+    res->warm_end = 0;
+    res->no_probe = 0;
+    res->ra_window = 0;
+    res->ra_end = 0;
+    res->ra_ms = 0;
+    res->dropped_end = 0;
+    res->reader = (Fcache_Reader) {0};
+    res->is_reader = 0;
+    res->error = NULL;
+    return res;
+}
 
-    int is_range_given = req->range_start_given || req->range_end_given;
+static Http_Response*
+build_http_response(Server *serv, Http_Request *req, int keep_alive)
+{
+    Defer_Queue dq = NULL_DEFER_QUEUE;
 
-    res->error = NULL;
+    Http_Response *res = new_http_response();
+    int is_head_request = req_slice_eq(req, req->method, "HEAD");
 
-    char *clean_http_path = cleanup_path(req->path);
+    char *http_path = req_slice_dup(req, req->path);
+    char *clean_http_path = cleanup_path(http_path);
+    free(http_path);
     char *decoded_http_path = decode_url(clean_http_path);
     free(clean_http_path);
     defer(&dq, free, decoded_http_path);
@@ -495,27 +951,35 @@ make_http_response(Server *serv, Http_Request *req)
     res->file_path = real_path;
     // NOTE: Don't free real_path, it's used outside this function
 
-    // Find out if we're listing a dir or serving a file
+    // Find out if we're listing a dir or serving a file. Cached
+    // files are known to be regular files that can be opened.
     res->file.name = get_base_name(real_path);
-    int read_result = read_file_info(&(res->file), real_path);
+    int read_result;
+    res->fcache_entry = fcache_get(&serv->fcache, real_path, serv->now_ms);
+    if (res->fcache_entry) {
+        Fcache_Entry *e = res->fcache_entry;
+        res->file = (File) {
+            .name = res->file.name,
+            .fd = e->fd,
+            .mode = e->st.st_mode,
+            .size = e->st.st_size,
+            .last_mod = e->st.st_mtime,
+        };
+        read_result = 1;
+    } else {
+        read_result = read_file_info(&(res->file), real_path);
+    }
 
     // File not found
     if (read_result == -1) {
         char *body = "Error 404: file not found\n";
 
-        // Status
-        buf_append_str(&res->head, "HTTP/1.1 404\r\n");
-
-        // Headers
-        /* TODO: have a function like
-            `write_standard_headers(buf, serv)` that puts
-            Connection, Keep-Alive, Date headers into buf */
-        buf_append_str(&res->head, "Accept-Ranges: bytes\r\n");
-        buf_append_str(&res->head, "Content-Type: text/plain\r\n");
-        buf_sprintf(&res->head, "Content-Length: %zu\r\n", strlen(body));
-        /*buf_sprintf(res->buf, "Keep-Alive: timeout=%d\r\n",
-            serv->conf.timeout_secs);*/
-        buf_append_str(&res->head, "\r\n");
+        start_head(serv, &res->head, 404, keep_alive);
+        BUF_APPEND_LIT(&res->head,
+                       "Accept-Ranges: bytes\r\n"
+                       "Content-Type: text/plain\r\n");
+        buf_append_header_num(&res->head, "Content-Length: ", strlen(body));
+        BUF_APPEND_LIT(&res->head, "\r\n");
 
         // Body
         if (!is_head_request) {
@@ -527,7 +991,8 @@ make_http_response(Server *serv, Http_Request *req)
 
     // Fatal error
     if (read_result == -2) {
-        buf_append_str(&res->head, "HTTP/1.1 500\r\n\r\n");
+        start_head(serv, &res->head, 500, keep_alive);
+        BUF_APPEND_LIT(&res->head, "Content-Length: 0\r\n\r\n");
         return fulfill(&dq, res);
     }
 
@@ -535,16 +1000,13 @@ make_http_response(Server *serv, Http_Request *req)
     if (res->file.is_dir) {
         // Forward to path with trailing slash if it's missing
         if (decoded_http_path[strlen(decoded_http_path) - 1] != '/') {
-            buf_sprintf(
-                &res->head,
-                "HTTP/1.1 301\r\n"
-                "Location: %s/\r\n",
-                decoded_http_path);
-            buf_append_str(&res->head, "Accept-Ranges: bytes\r\n");
-            /*buf_sprintf(
-                &res->head,
-                "Keep-Alive: timeout=%d\r\n\r\n",
-                serv->conf.timeout_secs);*/
+            start_head(serv, &res->head, 301, keep_alive);
+            BUF_APPEND_LIT(&res->head, "Location: ");
+            buf_append_str(&res->head, decoded_http_path);
+            BUF_APPEND_LIT(&res->head,
+                           "/\r\n"
+                           "Accept-Ranges: bytes\r\n"
+                           "Content-Length: 0\r\n\r\n");
             return fulfill(&dq, res);
         }
 
@@ -570,105 +1032,95 @@ make_http_response(Server *serv, Http_Request *req)
             }
         }
 
+        // Listings are generated, ranges of them are ignored
         if (index_found == 0) {
             init_buf(&res->body, RESPONSE_BODY_BUF_INIT_SIZE);
             write_dirlisting_http(
+                serv,
                 &res->head,
                 &res->body,
                 real_path,
-                decoded_http_path);
+                decoded_http_path,
+                keep_alive);
+            return fulfill(&dq, res);
+        }
+    }
 
-            // Check if the ranges given are invalid
-            if (is_range_given &&
-                !are_ranges_satisfiable(req, res->body.n_items)) {
-                // TODO: return 'range cannot be satisfied' error
+    // None of the ranges are in the file. Only the head is sent, so
+    // a cached fd isn't needed.
+    if (req->n_ranges > 0) {
+        memcpy(res->ranges, req->ranges, sizeof(req->ranges));
+        res->n_ranges = resolve_ranges(res->ranges, req->n_ranges,
+                                       res->file.size);
+        if (res->n_ranges == 0) {
+            if (res->fcache_entry) {
+                fcache_release(res->fcache_entry);
+                res->fcache_entry = NULL;
+                res->file.fd = -1;
             }
-
-            // Set ranges
-            res->range_start = req->range_start_given ?
-                req->range_start : 0;
-            res->range_end = req->range_end_given ?
-                req->range_end : (off_t) res->body.n_items - 1;
-
+            start_head(serv, &res->head, 416, keep_alive);
+            buf_append_header_num(&res->head, "Content-Range: bytes */",
+                                  res->file.size);
+            BUF_APPEND_LIT(&res->head, "Content-Length: 0\r\n\r\n");
             return fulfill(&dq, res);
         }
     }
 
-    // We're serving a single file
-
-    // Set ranges and file_offset
-    res->range_start = req->range_start_given ?
-        req->range_start : 0;
-    res->range_end = req->range_end_given ?
-        req->range_end : (off_t) res->file.size - 1;
-    res->file_offset = res->range_start;
-
-    if (is_range_given) {
-        if (!are_ranges_satisfiable(req, res->file.size)) {
-            // TODO: return 'range cannot be satisfied' error
+    // We're serving a single file. Keep it open until the response
+    // is freed, so that write_file() doesn't have to reopen it and
+    // the whole body comes from the same file.
+    if (!res->fcache_entry) {
+        struct stat sb;
+        if (open_file(&res->file, real_path, &sb) != 1 || res->file.is_dir) {
+            start_head(serv, &res->head, 500, keep_alive);
+            BUF_APPEND_LIT(&res->head, "Content-Length: 0\r\n\r\n");
+            return fulfill(&dq, res);
         }
 
-        buf_append_str(&res->head, "HTTP/1.1 206\r\n");
-    } else {
-        buf_append_str(&res->head, "HTTP/1.1 200\r\n");
-        buf_append_str(&res->head, "Accept-Ranges: bytes\r\n");
+        // Share the fd with later requests for the same file
+        res->fcache_entry = fcache_put(&serv->fcache, real_path,
+                                       res->file.fd, &sb, serv->now_ms);
     }
 
-    // Keep-Alive
-    /*buf_sprintf(
-        &res->head,
-        "Keep-Alive: timeout=%d\r\n",
-        serv->conf.timeout_secs);*/
+    if (res->n_ranges == 0) {
+        start_head(serv, &res->head, 200, keep_alive);
+        BUF_APPEND_LIT(&res->head, "Accept-Ranges: bytes\r\n");
+    } else {
+        start_head(serv, &res->head, 206, keep_alive);
+    }
 
     // Last-Modified
-    char tmp[DATE_LEN * 10];
-    buf_sprintf(&res->head,
-                "Last-Modified: %s\r\n",
-                to_rfc1123_date(tmp, res->file.last_mod));
-
-    // Content-Range
-    if (is_range_given) {
-        buf_sprintf(&res->head,
-            "Content-Range: bytes %ld-%ld/%ld\r\n",
-            res->range_start, res->range_end, res->file.size);
+    buf_append_header_date(&res->head, "Last-Modified: ",
+                           res->file.last_mod);
+
+    // Content-Range, or the parts of a multipart/byteranges body.
+    // Any boundary that doesn't turn up in the file will do.
+    char *type = get_content_type(res->file.name);
+    off_t content_length = res->file.size;
+    char boundary[17];
+    if (res->n_ranges == 1) {
+        Http_Range *r = res->ranges;
+        buf_append_content_range(&res->head, r, res->file.size);
+        content_length = r->last + 1 - r->first;
+    } else if (res->n_ranges > 1) {
+        snprintf(boundary, sizeof(boundary), "%016llx",
+                 (unsigned long long) next_random(serv));
+        content_length = write_byteranges_parts(res, boundary, type);
     }
 
     // Content-Length
-    buf_sprintf(&res->head,
-                "Content-Length: %ld\r\n",
-                res->file.size);
+    buf_append_header_num(&res->head, "Content-Length: ", content_length);
 
     // Content-Type
-    // TODO: replace this with a table lookup
-    if (strstr(res->file.name, ".html")) {
-        buf_append_str(
-            &res->head,
-            "Content-Type: text/html; charset=UTF-8\r\n");
-    } else if (strstr(res->file.name, ".jpg")) {
-        buf_append_str(
-            &res->head,
-            "Content-Type: image/jpeg\r\n");
-    } else if (strstr(res->file.name, ".pdf")) {
-        buf_append_str(
-            &res->head,
-            "Content-Type: application/pdf\r\n");
-    } else if (strstr(res->file.name, ".css")) {
-        buf_append_str(
-            &res->head,
-            "Content-Type: text/css\r\n");
-    } else if (strstr(res->file.name, ".txt")) {
-        buf_append_str(
-            &res->head,
-            "Content-Type: text/plain; charset=UTF-8\r\n");
-    } else if (strstr(res->file.name, ".mp4")) {
-        buf_append_str(
-            &res->head,
-            "Content-Type: video/mp4\r\n");
+    if (res->n_ranges > 1) {
+        BUF_APPEND_LIT(&res->head,
+                       "Content-Type: multipart/byteranges; boundary=");
+        buf_append_str(&res->head, boundary);
     } else {
-        buf_append_str(
-            &res->head,
-            "Content-Type: application/octet-stream; charset=UTF-8\r\n");
+        BUF_APPEND_LIT(&res->head, "Content-Type: ");
+        buf_append_str(&res->head, type);
     }
+    BUF_APPEND_LIT(&res->head, "\r\n");
 
     //ascii_dump_buf(stdout, res.data, res.n_items);
 
@@ -678,6 +1130,32 @@ make_http_response(Server *serv, Http_Request *req)
     return fulfill(&dq, res);
 }
 
+Http_Response*
+make_http_response(Server *serv, Http_Request *req, int keep_alive)
+{
+    Http_Response *res = build_http_response(serv, req, keep_alive);
+    queue_http_response(res, req_slice_eq(req, req->method, "HEAD"));
+    return res;
+}
+
+// For requests that can't be answered normally, the connection is
+// closed after it
+Http_Response*
+make_error_http_response(Server *serv, int status, char *body)
+{
+    Http_Response *res = new_http_response();
+
+    start_head(serv, &res->head, status, 0);
+    BUF_APPEND_LIT(&res->head, "Content-Type: text/plain\r\n");
+    buf_append_header_num(&res->head, "Content-Length: ", strlen(body));
+    BUF_APPEND_LIT(&res->head, "\r\n");
+    init_buf(&res->body, strlen(body) + 1);
+    buf_append_str(&res->body, body);
+
+    queue_http_response(res, 0);
+    return res;
+}
+
 void
 print_http_response(FILE *stream, Http_Response *res)
 {
@@ -724,8 +1202,17 @@ free_http_response(Http_Response *res)
         free(res->file_path);
         res->file_path = NULL;
     }
+    if (res->fcache_entry) {
+        if (res->is_reader)
+            fcache_remove_reader(res->fcache_entry, &res->reader);
+
+        // The cache closes the fd once nobody uses it
+        res->file.fd = -1;
+        fcache_release(res->fcache_entry);
+    }
     free_buf_parts(&res->head);
     free_buf_parts(&res->body);
+    free_buf_parts(&res->parts);
     free_file_parts(&res->file);
     free(res);
     res = NULL;
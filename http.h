@@ -5,12 +5,29 @@
 #include "mimino.h"
 #include "buffer.h"
 
-Http_Request* parse_http_request(Http_Request*);
-int is_http_end(char *buf, size_t size);
+#define P_ERROR   -1 // bad request, see req->error
+#define P_PARTIAL  0 // head not complete yet
+#define P_COMPLETE 1 // head parsed up to req->head_len
+
+int parse_http_request(Http_Request*);
 void print_http_request(FILE*, Http_Request*);
+void reset_http_request(Http_Request*);
 void free_http_request(Http_Request*);
 
-Http_Response* make_http_response(Server *serv, Http_Request* req);
+char* req_slice(Http_Request*, Http_Slice);
+int req_slice_eq(Http_Request*, Http_Slice, char*);
+int req_slice_case_eq(Http_Request*, Http_Slice, char*);
+char* req_slice_dup(Http_Request*, Http_Slice);
+
+int parse_range_header(char *str, size_t len, Http_Range *ranges);
+int resolve_ranges(Http_Range *ranges, int n, off_t size);
+
+typedef void (*Header_Handler)(Http_Request*, Http_Slice);
+Header_Handler get_header_handler(char *name, size_t len);
+
+Http_Response* make_error_http_response(Server *serv, int status, char *body);
+Http_Response* make_http_response(Server *serv, Http_Request* req,
+                                  int keep_alive);
 void print_http_response(FILE*, Http_Response*);
 void free_http_response(Http_Response*);
 
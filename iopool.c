@@ -0,0 +1,187 @@
+// iopool - threads for blocking file reads
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "iopool.h"
+#include "xmalloc.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#define IO_READ_CHUNK (1 << 16)
+
+// Reads the range, which leaves it in the page cache
+static int
+do_job(Io_Job *job, char *buf)
+{
+    size_t done = 0;
+    while (done < job->len) {
+        size_t n = job->len - done;
+        if (n > IO_READ_CHUNK) n = IO_READ_CHUNK;
+
+        ssize_t got = pread(job->fd, buf, n, job->offset + done);
+        if (got == -1) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (got == 0) break; // EOF
+        done += got;
+    }
+    return 0;
+}
+
+static void*
+io_thread(void *arg)
+{
+    Io_Pool *p = arg;
+    char *buf = xmalloc(IO_READ_CHUNK);
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->todo && !p->stop)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->stop) break;
+
+        Io_Job *job = p->todo;
+        p->todo = job->next;
+        if (!p->todo) p->todo_tail = NULL;
+        pthread_mutex_unlock(&p->lock);
+
+        job->error = do_job(job, buf);
+        close(job->fd);
+        job->fd = -1;
+
+        pthread_mutex_lock(&p->lock);
+        job->next = p->done;
+        p->done = job;
+
+        uint64_t one = 1;
+        if (write(p->efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            perror("write() on io pool eventfd");
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    free(buf);
+    return NULL;
+}
+
+// Returns 0 on success or -1 if the pool can't be used
+int
+io_pool_init(Io_Pool *p, int n_threads)
+{
+    *p = (Io_Pool) { .efd = -1 };
+    if (n_threads <= 0) return -1;
+
+#ifdef __linux__
+    p->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+    if (p->efd == -1) {
+        perror("eventfd() inside io_pool_init()");
+        return -1;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    p->threads = xmalloc(sizeof(pthread_t) * n_threads);
+    for (int i = 0; i < n_threads; i++) {
+        int err = pthread_create(p->threads + i, NULL, io_thread, p);
+        if (err) {
+            fprintf(stderr, "pthread_create() inside io_pool_init(): %s\n",
+                    strerror(err));
+            break;
+        }
+        p->n_threads++;
+    }
+
+    if (p->n_threads == 0) {
+        free_io_pool_parts(p);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+free_io_pool_parts(Io_Pool *p)
+{
+    if (p->efd == -1) return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->n_threads; i++)
+        pthread_join(p->threads[i], NULL);
+    free(p->threads);
+
+    while (p->todo) {
+        Io_Job *job = p->todo;
+        p->todo = job->next;
+        close(job->fd);
+        free(job);
+    }
+    while (p->done) {
+        Io_Job *job = p->done;
+        p->done = job->next;
+        free(job);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    close(p->efd);
+    p->efd = -1;
+}
+
+// Queues a read of len bytes of fd at offset. fd is dup()ed, so the
+// caller may close its own before the job is done. Returns 0 on
+// success or -1 on error.
+int
+io_pool_submit(Io_Pool *p, int fd, off_t offset, size_t len, uint64_t key)
+{
+    int job_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (job_fd == -1) {
+        perror("fcntl(F_DUPFD_CLOEXEC) inside io_pool_submit()");
+        return -1;
+    }
+
+    Io_Job *job = xmalloc(sizeof(Io_Job));
+    *job = (Io_Job) {
+        .fd = job_fd,
+        .offset = offset,
+        .len = len,
+        .key = key,
+    };
+
+    pthread_mutex_lock(&p->lock);
+    if (p->todo_tail) p->todo_tail->next = job;
+    else p->todo = job;
+    p->todo_tail = job;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    return 0;
+}
+
+// Returns the list of finished jobs, linked through ->next, for
+// the caller to free. Call when efd is readable.
+Io_Job*
+io_pool_take_done(Io_Pool *p)
+{
+    uint64_t n;
+    if (read(p->efd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("read() on io pool eventfd");
+
+    pthread_mutex_lock(&p->lock);
+    Io_Job *done = p->done;
+    p->done = NULL;
+    pthread_mutex_unlock(&p->lock);
+
+    return done;
+}
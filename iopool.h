@@ -0,0 +1,44 @@
+#ifndef _MIMINO_IOPOOL_H
+#define _MIMINO_IOPOOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define IO_POOL_DEFAULT_THREADS 2
+
+/*
+  A pool of threads that pull file ranges into the page cache, so
+  the event loop never blocks on a disk read. The loop submits a job
+  and watches efd; once it's readable, io_pool_take_done() returns
+  the finished jobs. key is whatever the submitter needs to find
+  its connection again.
+*/
+typedef struct Io_Job {
+    int fd; // dup()ed, closed by the pool
+    off_t offset;
+    size_t len;
+    uint64_t key;
+    int error; // errno of a failed read, 0 on success
+    struct Io_Job *next;
+} Io_Job;
+
+typedef struct {
+    pthread_t *threads;
+    int n_threads;
+    int efd; // readable while there are finished jobs
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Io_Job *todo;
+    Io_Job *todo_tail;
+    Io_Job *done;
+    int stop;
+} Io_Pool;
+
+int io_pool_init(Io_Pool *p, int n_threads);
+void free_io_pool_parts(Io_Pool *p);
+int io_pool_submit(Io_Pool *p, int fd, off_t offset, size_t len, uint64_t key);
+Io_Job* io_pool_take_done(Io_Pool *p);
+
+#endif // _MIMINO_IOPOOL_H
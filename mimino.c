@@ -2,11 +2,14 @@
   Mimino - small http server
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -17,6 +20,17 @@
 #include <dirent.h>
 #include <time.h>
 #include <ifaddrs.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/sockios.h>
+#endif
 #include "mimino.h"
 #include "fdwatch.h"
 #include "xmalloc.h"
@@ -25,8 +39,10 @@
 #include "arg.h"
 #include "connection.h"
 
-int sockbind(struct addrinfo *ai);
+int sockbind(struct addrinfo *ai, Server_Config *conf);
+int set_sock_opts(int s, Server_Config *conf);
 int send_buf(int sock, char *buf, size_t nbytes);
+ssize_t send_file(int sock, int fd, off_t *offset, size_t len);
 void *get_in_addr(struct sockaddr *sa);
 unsigned short get_in_port(struct sockaddr *sa);
 void hex_dump_line(FILE *stream, char *buf, size_t buf_size, size_t width);
@@ -54,7 +70,25 @@ print_server_config(Server_Config *conf)
     printf("  .chroot_dir = \"%s\",\n", conf->chroot_dir);
     printf("  .max_fds = %d,\n", conf->max_fds);
     printf("  .timeout_secs = %d,\n", conf->timeout_secs);
-    printf("  .poll_interval_ms = %d,\n", conf->poll_interval_ms);
+    printf("  .read_timeout_secs = %d,\n", conf->read_timeout_secs);
+    printf("  .write_timeout_secs = %d,\n", conf->write_timeout_secs);
+    printf("  .engine = \"%s\",\n", fdwatch_backend_name(conf->engine));
+    printf("  .workers = %d,\n", conf->workers);
+    printf("  .threads = %d,\n", conf->threads);
+    printf("  .pin_cpus = %d,\n", conf->pin_cpus);
+    printf("  .accept_batch = %d,\n", conf->accept_batch);
+    printf("  .backlog = %d,\n", conf->backlog);
+    printf("  .defer_accept_secs = %d,\n", conf->defer_accept_secs);
+    printf("  .nodelay = %d,\n", conf->nodelay);
+    printf("  .sndbuf = %d,\n", conf->sndbuf);
+    printf("  .rcvbuf = %d,\n", conf->rcvbuf);
+    printf("  .notsent_lowat = %d,\n", conf->notsent_lowat);
+    printf("  .fcache_entries = %d,\n", conf->fcache_entries);
+    printf("  .io_threads = %d,\n", conf->io_threads);
+    printf("  .stream_min_size = %lld,\n", (long long) conf->stream_min_size);
+    printf("  .write_quantum = %d,\n", conf->write_quantum);
+    printf("  .small_first = %d,\n", conf->small_first);
+    printf("  .max_request_size = %d,\n", conf->max_request_size);
     printf("}\n\n");
 }
 
@@ -64,10 +98,12 @@ print_server_state(Server *serv)
     printf("time_now: %ld\n", serv->time_now);
     printf("n_conns_alloc: %zu\n", serv->queue.n_conns_alloc);
     printf("n_conns: %zu\n", serv->queue.n_conns);
+    printf("n_live: %zu\n", serv->queue.n_live);
     for (nfds_t i = 1; i < serv->queue.n_conns; i++) {
+        if (serv->queue.pollfds[i].fd == -1) continue;
         printf("Connection %zu:\n", i);
         print_connection(serv->queue.pollfds + i,
-                         serv->queue.conns + i);
+                         get_conn(&serv->queue, i));
         printf("------------\n");
     }
 }
@@ -110,8 +146,9 @@ print_server_lan_addr(char *port)
 }
 
 int
-init_server(char *port, struct addrinfo *server_addrinfo)
+init_server(Server_Config *conf, struct addrinfo *server_addrinfo)
 {
+    char *port = conf->port;
     int sockfd;
     /* char ip_str[INET6_ADDRSTRLEN]; */
 
@@ -167,7 +204,7 @@ init_server(char *port, struct addrinfo *server_addrinfo)
 
     // Try binding to ipv4 (prefer ipv4 over ipv6)
     for (int i = 0; i < ipv4_addrinfos_i; i++) {
-        sockfd = sockbind(ipv4_addrinfos[i]);
+        sockfd = sockbind(ipv4_addrinfos[i], conf);
         if (sockfd != -1) {
             memcpy(server_addrinfo, ipv4_addrinfos[i], sizeof(*server_addrinfo));
             bound = 1;
@@ -178,7 +215,7 @@ init_server(char *port, struct addrinfo *server_addrinfo)
     // Try binding to ipv6
     if (!bound) {
         for (int i = 0; i < ipv6_addrinfos_i; i++) {
-            sockfd = sockbind(ipv6_addrinfos[i]);
+            sockfd = sockbind(ipv6_addrinfos[i], conf);
             if (sockfd != -1) {
                 memcpy(server_addrinfo, ipv6_addrinfos[i], sizeof(*server_addrinfo));
                 bound = 1;
@@ -194,65 +231,170 @@ init_server(char *port, struct addrinfo *server_addrinfo)
     return bound ? sockfd : -1;
 }
 
+// Adds a chunk of CONN_CHUNK_SIZE free slots. Live connections
+// stay where they are.
+void
+grow_conn_pool(Poll_Queue *q)
+{
+    nfds_t old_alloc = q->n_conns_alloc;
+    nfds_t n_chunks = old_alloc / CONN_CHUNK_SIZE;
+    q->n_conns_alloc += CONN_CHUNK_SIZE;
+
+    q->conn_chunks = xrealloc(q->conn_chunks,
+                              sizeof(q->conn_chunks[0]) * (n_chunks + 1));
+    q->conn_chunks[n_chunks] = xmalloc(sizeof(Connection) * CONN_CHUNK_SIZE);
+    memset(q->conn_chunks[n_chunks], 0, sizeof(Connection) * CONN_CHUNK_SIZE);
+
+    q->pollfds = xrealloc(q->pollfds,
+                          sizeof(q->pollfds[0]) * q->n_conns_alloc);
+    q->free_slots = xrealloc(q->free_slots,
+                             sizeof(q->free_slots[0]) * q->n_conns_alloc);
+
+    // Push in reverse, so that the lowest slots are used first
+    for (nfds_t i = q->n_conns_alloc; i > old_alloc; i--) {
+        q->pollfds[i - 1] = (struct pollfd) { .fd = -1 };
+        q->free_slots[q->n_free++] = i - 1;
+    }
+}
+
 void
 init_conn_pool(Server *serv)
 {
-    serv->queue.n_conns_alloc = MIN(serv->conf.max_fds, 1024);
-    serv->queue.n_conns = 0;
-    serv->queue.pollfds = xmalloc(
-        sizeof(struct pollfd) * serv->queue.n_conns_alloc);
-    serv->queue.conns = xmalloc(
-        sizeof(Connection) * serv->queue.n_conns_alloc);
+    serv->queue = (Poll_Queue) {0};
+    grow_conn_pool(&serv->queue);
+}
+
+// Takes a slot off the free list
+nfds_t
+alloc_conn_slot(Poll_Queue *q)
+{
+    if (q->n_free == 0)
+        grow_conn_pool(q);
+
+    nfds_t i = q->free_slots[--q->n_free];
+    if (i >= q->n_conns)
+        q->n_conns = i + 1;
+    q->n_live++;
+
+    return i;
 }
 
-// Returns the socket fd of the new connection
+// Returns the socket fd of the new connection or -1 if there are
+// no more pending connections or accepting failed
 int
-accept_new_conn(int listen_sock)
+accept_new_conn(int listen_sock, Server_Config *conf)
 {
     int newsock;
-    int saved_errno;
-    char their_ip_str[INET6_ADDRSTRLEN];
     struct sockaddr_storage their_addr;
     socklen_t their_addr_size = sizeof(their_addr);
 
-    // Accept new connection
-    // TODO: set O_NONBLOCK and check for EWOULDBLOCK. Right now this will block
-    newsock = accept(listen_sock, (struct sockaddr *)&their_addr, &their_addr_size);
-    saved_errno = errno;
-    if (newsock == -1) {
-        if (saved_errno != EAGAIN) {
-            fprintf(stderr, "%d", saved_errno);
+    while (1) {
+#ifdef SOCK_NONBLOCK
+        // Don't block on newsock and don't leak it into children
+        newsock = accept4(listen_sock,
+                          (struct sockaddr *)&their_addr,
+                          &their_addr_size,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        newsock = accept(listen_sock,
+                         (struct sockaddr *)&their_addr,
+                         &their_addr_size);
+        if (newsock != -1 && fcntl(newsock, F_SETFL, O_NONBLOCK) != 0) {
+            perror("fcntl()");
+            close(newsock);
+            return -1;
+        }
+#endif
+        if (newsock != -1)
+            break;
+
+        switch (errno) {
+        case EINTR:
+        case ECONNABORTED:
+            // Try the next one
+            continue;
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+            // Backlog drained
+            return -1;
+        default:
             perror("accept()");
+            return -1;
         }
     }
 
-    // Don't block on newsock
-    if (fcntl(newsock, F_SETFL, O_NONBLOCK) != 0) {
-        perror("fcntl()");
+#ifndef __linux__
+    // Linux copies the listen_sock options to accepted sockets,
+    // elsewhere they have to be set again
+    if (set_sock_opts(newsock, conf) == -1) {
+        close(newsock);
+        return -1;
     }
+#else
+    (void) conf;
+#endif
 
-    // Print their_addr
-    inet_ntop(their_addr.ss_family,
-              get_in_addr((struct sockaddr *)&their_addr),
-              their_ip_str, sizeof(their_ip_str));
+    /* char their_ip_str[INET6_ADDRSTRLEN]; */
+    /* inet_ntop(their_addr.ss_family, */
+    /*           get_in_addr((struct sockaddr *)&their_addr), */
+    /*           their_ip_str, sizeof(their_ip_str)); */
     /* printf("Got connection from %s:%d\n", their_ip_str, */
     /*        ntohs(get_in_port((struct sockaddr *)&their_addr))); */
 
     return newsock;
 }
 
+// Pipelined responses written back to back before letting the other
+// connections have their turn
+#define PIPELINE_BATCH 16
+
 #define R_CLIENT_CLOSED 2 // client closed connection.
 #define R_COMPLETE_READ 1 // done reading completely.
 #define R_PARTIAL_READ  0 // an incomplete read happened.
 #define R_FATAL_ERROR  -1 // fatal error or max retry reached.
 #define R_REQ_TOO_BIG  -2 // when request is too big to handle.
+
+// Moves the request to the next bigger pooled buffer. Slices are
+// offsets, so they stay valid. Returns -1 if there's none.
+static int
+grow_request_buf(Server *serv, Http_Request *req)
+{
+    Buffer *big = buf_pool_get(&serv->buf_pool, req->buf->n_alloc + 1);
+    if (!big) return -1;
+
+    memcpy(big->data, req->buf->data, req->buf->n_items);
+    big->n_items = req->buf->n_items;
+    buf_pool_put(&serv->buf_pool, req->buf);
+    req->buf = big;
+    return 0;
+}
+
+// Gives a pooled buffer back once what's left of it fits a small one
+static void
+shrink_request_buf(Server *serv, Http_Request *req)
+{
+    if (req->buf->n_alloc <= REQUEST_BUF_SIZE ||
+        req->buf->n_items > REQUEST_BUF_SIZE)
+        return;
+
+    Buffer *small = new_buf(REQUEST_BUF_SIZE);
+    memcpy(small->data, req->buf->data, req->buf->n_items);
+    small->n_items = req->buf->n_items;
+    buf_pool_put(&serv->buf_pool, req->buf);
+    req->buf = small;
+}
+
 int
-read_request(Connection *conn)
+read_request(Server *serv, Connection *conn)
 {
-    int n = recv(conn->fd,
-                 conn->req->buf->data + conn->req->buf->n_items,
-                 conn->req->buf->n_alloc - conn->req->buf->n_items,
-                 0);
+    Buffer *buf = conn->req->buf;
+    size_t cap = MIN(buf->n_alloc, (size_t) serv->conf.max_request_size);
+    int n = fdwatch_recv(&serv->fdwatch,
+                         conn->fd,
+                         buf->data + buf->n_items,
+                         cap - buf->n_items);
     if (n < 0) {
         int saved_errno = errno;
         if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
@@ -274,17 +416,22 @@ read_request(Connection *conn)
 
     conn->req->buf->n_items += n;
 
-    // Finished reading
-    if (is_http_end(conn->req->buf->data, conn->req->buf->n_items))
+    // Parse what came in, the parser stops at the end of the head
+    if (parse_http_request(conn->req) != P_PARTIAL)
         return R_COMPLETE_READ;
     if (n == 0) {
         if (conn->req->buf->n_items == 0) return R_CLIENT_CLOSED;
-        else return R_COMPLETE_READ;
+        conn->req->error = "Unexpected EOF";
+        return R_COMPLETE_READ;
     }
 
-    // Not finished yet, but req buffer full
-    if (conn->req->buf->n_items == conn->req->buf->n_alloc)
-        return R_REQ_TOO_BIG;
+    // Not finished yet, but req buffer full. Bodies are cut out of
+    // the buffer as they're read, so this is a big head.
+    if (buf->n_items == cap) {
+        if (cap == (size_t) serv->conf.max_request_size ||
+            grow_request_buf(serv, conn->req) == -1)
+            return R_REQ_TOO_BIG;
+    }
 
 
     // TODO: maybe decrease read_tries_left here? imagine that a
@@ -307,161 +454,432 @@ read_request(Connection *conn)
 #define W_FATAL_ERROR    -1
 #define W_PARTIAL_WRITE   0
 #define W_COMPLETE_WRITE  1
-int
-write_headers(Connection *conn)
-{
-    int sent = send_buf(
-        conn->fd,
-        conn->res->head.data + conn->res->head_nbytes_sent,
-        conn->res->head.n_items - conn->res->head_nbytes_sent);
+#define W_WAITING_IO      2
 
-    // Fatal error, no use retrying
-    if (sent == -1) {
-        conn->res->error = "write_headers(): Other error";
-        return W_FATAL_ERROR;
-    }
+// Bytes of a file checked for page cache misses at a time
+#define IO_WINDOW (1 << 19)
 
-    conn->res->head_nbytes_sent += sent;
+// File segments up to this size aren't probed, they're read without
+// waiting for the disk instead, see write_response()
+#define NOWAIT_MAX_SIZE (1 << 16)
 
-    // Retry later if not sent fully
-    if (conn->res->head_nbytes_sent < conn->res->head.n_items) {
-        if (conn->write_tries_left == 0) {
-            conn->res->error = "write_headers(): Max write tries reached";
-            return W_MAX_TRIES;
+// Readahead window bounds for streamed files
+#define STREAM_WINDOW_MIN (1 << 18)
+#define STREAM_WINDOW_MAX (1 << 23)
+
+#define STREAM_DEFAULT_MIN_SIZE (32 << 20)
+
+#define DEFAULT_WRITE_QUANTUM (256 << 10)
+
+// pread() that fails with EAGAIN instead of waiting for the disk
+static ssize_t
+pread_nowait(int fd, void *buf, size_t len, off_t offset)
+{
+#ifdef RWF_NOWAIT
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    return preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+#else
+    (void) fd; (void) buf; (void) len; (void) offset;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+// Copies up to seg->len bytes of the file through a buffer. Used
+// when sendfile() isn't available for the file or the socket, and
+// with nowait for small segments that may not be in the page cache.
+// Returns the number of bytes sent or -1 on error. With nowait, -1
+// and errno EAGAIN means none of it was cached.
+ssize_t
+copy_file(Connection *conn, Out_Seg *seg, int nowait)
+{
+    char file_buf[NOWAIT_MAX_SIZE];
+    size_t nbytes_sent = 0;
+
+    // This works without loading the entire file into memory
+    while (nbytes_sent < seg->len) {
+        size_t nbytes_to_read = MIN(sizeof(file_buf), seg->len - nbytes_sent);
+        off_t offset = seg->offset + nbytes_sent;
+        ssize_t bytes_read = nowait ?
+            pread_nowait(conn->res->file.fd, file_buf, nbytes_to_read, offset) :
+            pread(conn->res->file.fd, file_buf, nbytes_to_read, offset);
+        if (bytes_read == -1 && errno == EINTR)
+            continue;
+        if (bytes_read == -1 && nowait && errno == EOPNOTSUPP) {
+            // Can't tell what's cached on this file system
+            conn->res->no_probe = 1;
+            nowait = 0;
+            continue;
         }
-        conn->write_tries_left--;
+        if (bytes_read == -1 && nowait && errno == EAGAIN) {
+            // Send what was cached, the rest comes from the I/O pool
+            if (nbytes_sent > 0)
+                break;
+            return -1;
+        }
+        if (bytes_read <= 0) {
+            conn->res->error = bytes_read == -1 ?
+                "copy_file(): Error when pread()ing file" :
+                "copy_file(): File shrank while sending it";
+            return -1;
+        }
+
+        int sent = send_buf(conn->fd, file_buf, bytes_read);
+        if (sent == -1) {
+            conn->res->error = "copy_file(): send_buf() returned -1";
+            return -1;
+        }
+        nbytes_sent += sent;
 
-        return W_PARTIAL_WRITE;
+        // Socket is full, the rest of file_buf is read again next time
+        if (sent < bytes_read)
+            break;
     }
 
-    return W_COMPLETE_WRITE;
+    return nbytes_sent;
 }
 
-int
-write_body(Connection *conn)
+// Sends the file segment with sendfile(), falling back to copying
+// it. Returns the number of bytes sent or -1 on error.
+ssize_t
+write_file(Connection *conn, Out_Seg *seg)
 {
-    if (conn->res->body.data == NULL) {
-        printf("Eror: Response for conn with fd %d has empty body\n",
-            conn->fd);
-        return W_FATAL_ERROR;
+    if (conn->res->file.fd == -1) {
+        conn->res->error = "write_file(): File isn't open";
+        return -1;
     }
 
-    int sent = send_buf(
-        conn->fd,
-        conn->res->body.data +
-          (conn->res->range_start + conn->res->body_nbytes_sent),
-        conn->res->range_end + 1 - conn->res->body_nbytes_sent);
+    if (conn->res->no_sendfile)
+        return copy_file(conn, seg, 0);
 
-    // Fatal error, no use retrying
-    if (sent == -1) {
-        conn->res->error = "write_body(): Other error";
-        return W_FATAL_ERROR;
+    off_t offset = seg->offset;
+    ssize_t sent = send_file(conn->fd, conn->res->file.fd, &offset, seg->len);
+    if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        // Not supported for this file, copy it from now on
+        conn->res->no_sendfile = 1;
+        return copy_file(conn, seg, 0);
     }
+    if (sent == -1)
+        conn->res->error = "write_file(): send_file() returned -1";
 
-    conn->res->body_nbytes_sent += sent;
+    return sent;
+}
 
-    // Retry later if not sent fully
-    if (conn->res->range_start + (off_t) conn->res->body_nbytes_sent <
-        conn->res->range_end + 1) {
-        if (conn->write_tries_left == 0) {
-            conn->res->error = "write_body(): Max write tries reached";
-            return W_MAX_TRIES;
-        }
-        conn->write_tries_left--;
+// Returns how many bytes from offset, up to len, are in the page
+// cache, or -1 if that can't be told. Mapping the range doesn't read
+// it in, mincore() then checks every page of it.
+ssize_t
+probe_page_cache(int fd, off_t offset, size_t len)
+{
+    unsigned char vec[IO_WINDOW / 4096 + 1];
+    size_t page = sysconf(_SC_PAGESIZE);
+    off_t start = offset - offset % page;
+    size_t map_len = MIN(offset - start + len, sizeof(vec) * page);
 
-        return W_PARTIAL_WRITE;
+    if (len == 0)
+        return 0;
+
+    void *p = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, start);
+    if (p == MAP_FAILED)
+        return -1;
+    int ok = mincore(p, map_len, vec) == 0;
+    munmap(p, map_len);
+    if (!ok)
+        return -1;
+
+    size_t n_pages = (map_len + page - 1) / page;
+    size_t i = 0;
+    while (i < n_pages && (vec[i] & 1))
+        i++;
+
+    size_t warm = i * page - (offset - start);
+    return i == 0 ? 0 : (ssize_t) MIN(warm, len);
+}
+
+// Returns how many bytes of the file segment can be sent without
+// waiting for the disk, or 0 if the I/O pool has to read them in
+// first. Without a pool everything is sent right away.
+size_t
+get_warm_len(Server *serv, Connection *conn, Out_Seg *seg)
+{
+    Http_Response *res = conn->res;
+    if (serv->io_idx == 0 || res->no_probe)
+        return seg->len;
+
+    if (seg->offset < res->warm_end)
+        return MIN(seg->len, (size_t) (res->warm_end - seg->offset));
+
+    ssize_t warm = probe_page_cache(res->file.fd, seg->offset,
+                                    MIN(seg->len, IO_WINDOW));
+    if (warm == -1) {
+        res->no_probe = 1;
+        return seg->len;
     }
+    res->warm_end = seg->offset + warm;
+    return warm;
+}
+
+// Has the I/O pool read in the start of the file segment, on_io_done()
+// resumes the connection. Returns -1 if the pool is full, the segment
+// is then read right here.
+static int
+submit_io(Server *serv, Connection *conn, Out_Seg *seg)
+{
+    Http_Response *res = conn->res;
+    if (io_pool_submit(&serv->io_pool, res->file.fd, seg->offset,
+                       MIN(seg->len, IO_WINDOW), get_conn_handle(conn)) == 0)
+        return 0;
 
-    return W_COMPLETE_WRITE;
+    res->no_probe = 1;
+    return -1;
 }
 
-int
-write_file(Connection *conn)
+/*
+  Streams large files, called before sending from offset. Readahead
+  is issued a window ahead of the client, and sent pages are dropped
+  from the page cache so that a few big downloads don't evict the
+  small hot files.
+
+  Cached fds are shared by every response for the file, and dropped
+  pages are gone for all of them, so with more than one response
+  only the part every one of them has sent is dropped. The fd's own
+  readahead settings are left alone for the same reason.
+
+  The window doubles when the client went through the last one in
+  under a second and halves when it took over four seconds, which
+  keeps a second or two of the download read ahead.
+*/
+void
+stream_file(Server *serv, Connection *conn, off_t offset)
 {
-    Defer_Queue dq = NULL_DEFER_QUEUE;
+#ifdef POSIX_FADV_DONTNEED
+    Http_Response *res = conn->res;
+    off_t min_size = serv->conf.stream_min_size;
+    if (min_size == 0 || res->file.size < min_size)
+        return;
 
-    if (conn->res->file.is_null) {
-        printf("Eror: File is null for conn with fd %d\n",
-            conn->fd);
-        return W_FATAL_ERROR;
+    int fd = res->file.fd;
+    if (res->ra_window == 0) {
+        res->ra_window = STREAM_WINDOW_MIN;
+        res->ra_end = offset;
+        res->dropped_end = offset;
+        res->reader.sent_end = offset;
+        if (res->fcache_entry) {
+            fcache_add_reader(res->fcache_entry, &res->reader);
+            res->is_reader = 1;
+        }
     }
 
-    char file_buf[4096];
-    size_t file_buf_len = sizeof(file_buf) * sizeof(char);
-    size_t nbytes_left = conn->res->range_end - conn->res->file_offset;
-    size_t nbytes_to_read = file_buf_len < nbytes_left ?
-        file_buf_len : nbytes_left;
+    // Find out what's been sent a window at a time. Pages still in
+    // the socket's send queue can't be dropped yet.
+    if (offset - res->reader.sent_end >= STREAM_WINDOW_MIN) {
+        off_t sent_end = offset;
+#ifdef SIOCOUTQ
+        int queued = 0;
+        if (ioctl(conn->fd, SIOCOUTQ, &queued) == 0)
+            sent_end -= queued;
+#endif
+        res->reader.sent_end = MAX(sent_end, res->reader.sent_end);
+    }
 
-    // TODO: reuse file handle if partial file writes happen
-    // Open file
-    FILE *file_handle = fopen(conn->res->file_path, "r");
-    if (file_handle == NULL) {
-        perror("write_file(): Error on fopen()");
-        // TODO: handle various fopen() errors by switching errno here
-        return W_FATAL_ERROR;
+    // Drop up to where the slowest response of the file is
+    off_t drop_end = res->is_reader ?
+        fcache_readers_low(res->fcache_entry) : res->reader.sent_end;
+    if (drop_end - res->dropped_end >= STREAM_WINDOW_MIN) {
+        posix_fadvise(fd, res->dropped_end, drop_end - res->dropped_end,
+                      POSIX_FADV_DONTNEED);
+        res->dropped_end = drop_end;
     }
-    defer(&dq, fclose, file_handle);
 
-    // Seek
-    if (conn->res->file_offset != 0) {
-        int err = fseeko(file_handle, conn->res->file_offset, SEEK_SET);
-        if (err) {
-            perror("write_file(): Error on fseeko()");
-            // TODO: handle various fseeko() errors by switching errno here
-            return fulfill(&dq, W_FATAL_ERROR);
-        }
+    // Refill once less than half a window is left
+    if (res->ra_end - offset > (off_t) res->ra_window / 2)
+        return;
+
+    if (res->ra_ms) {
+        long long took_ms = serv->now_ms - res->ra_ms;
+        if (took_ms < 1000)
+            res->ra_window = MIN(res->ra_window * 2, STREAM_WINDOW_MAX);
+        else if (took_ms > 4000)
+            res->ra_window = MAX(res->ra_window / 2, STREAM_WINDOW_MIN);
     }
 
-    // Start reading the file and sending it.
-    // This works without loading the entire file into memory.
-    while (1) {
-        size_t bytes_read = fread(
-            file_buf,
-            1,
-            nbytes_to_read,
-            file_handle);
-        if (bytes_read == 0) {
-            if (ferror(file_handle)) {
-                conn->res->error = "write_file(): Error when fread()ing file";
-                // TODO: think of an appropriate error to return here
-                return fulfill(&dq, W_FATAL_ERROR);
-            }
-            return W_COMPLETE_WRITE;
-        }
+    off_t start = MAX(res->ra_end, offset);
+    posix_fadvise(fd, start, res->ra_window, POSIX_FADV_WILLNEED);
+    res->ra_end = start + res->ra_window;
+    res->ra_ms = serv->now_ms;
+#else
+    (void) serv; (void) conn; (void) offset;
+#endif
+}
 
-        int sent = send_buf(conn->fd, file_buf, bytes_read);
-        if (sent == -1) {
-            conn->res->error = "write_file(): send_buf() returned -1";
-            return fulfill(&dq, W_FATAL_ERROR);
-        }
+// Consumes n sent bytes from the front of the output queue
+static void
+out_advance(Http_Response *res, size_t n)
+{
+    res->nbytes_sent += n;
 
-        conn->res->file_offset += sent;
-        conn->res->file_nbytes_sent += sent; // TODO: useless?
+    while (n > 0 && res->seg_i < res->n_segs) {
+        Out_Seg *seg = res->segs + res->seg_i;
+        size_t k = MIN(n, seg->len);
+        if (seg->type == OUT_SEG_MEM) seg->data += k;
+        else seg->offset += k;
+        seg->len -= k;
+        n -= k;
 
-        // Retry later if not sent at all
+        if (seg->len == 0) res->seg_i++;
+    }
+}
 
-        // TODO: a better mechanic for dropping unresponsive
-        // clients is to time the activity: if the client doesn't
-        // receive any data for x seconds, drop the connection
-        if ((size_t) sent == 0) {
-            // This only happens when the client has a sudden
-            // disconnection. Retrying later gives the client
-            // some time to regain the connection.
+/*
+  Sends as much of the response's output queue as the socket takes.
+  Consecutive memory segments (head and in-memory body) go out in a
+  single sendmsg(), so small responses take one syscall and leave in
+  one packet. File segments are sent with write_file().
+
+  When a file follows the memory segments, they are sent with
+  MSG_MORE, which corks the head until the file data is appended to
+  it, instead of sending the head in a packet of its own.
+
+  File data that isn't in the page cache is handed to the I/O pool
+  and W_WAITING_IO is returned, so the loop doesn't block on disk.
+
+  Connections are served with deficit round robin: every call adds
+  write_quantum bytes to conn->deficit and whatever is sent is taken
+  off it. File data stops when it runs out, the rest is sent on the
+  next round, after the other ready connections had their turn. The
+  head is always sent whole, going over the deficit is paid back in
+  the next round. Credit isn't saved up while the socket is full.
+*/
+int
+write_response(Server *serv, Connection *conn)
+{
+    Http_Response *res = conn->res;
+    size_t nbytes_sent = res->nbytes_sent;
+    int limited = serv->conf.write_quantum > 0;
+    int blocked = 0;
+    int out_of_turn = 0;
+
+    if (limited)
+        conn->deficit += serv->conf.write_quantum;
+
+    while (res->seg_i < res->n_segs) {
+        Out_Seg *seg = res->segs + res->seg_i;
+        size_t len = 0;
+        ssize_t sent;
+
+        // The socket may well take more, but it's the next one's turn
+        if (limited && conn->deficit <= 0) {
+            out_of_turn = 1;
+            break;
+        }
 
-            if (conn->write_tries_left == 0) {
-                conn->res->error = "write_file(): Max write tries reached";
-                return fulfill(&dq, W_MAX_TRIES);
+        if (seg->type == OUT_SEG_MEM) {
+            struct iovec iov[OUT_SEGS_MAX];
+            int n_iov = 0;
+            int i;
+            for (i = res->seg_i; i < res->n_segs; i++) {
+                if (res->segs[i].type != OUT_SEG_MEM) break;
+                iov[n_iov++] = (struct iovec) {
+                    .iov_base = res->segs[i].data,
+                    .iov_len = res->segs[i].len,
+                };
+                len += res->segs[i].len;
             }
-            conn->write_tries_left--;
 
-            return fulfill(&dq, W_PARTIAL_WRITE);
+            struct msghdr msg = {
+                .msg_iov = iov,
+                .msg_iovlen = n_iov,
+            };
+            int flags = 0;
+#ifdef MSG_MORE
+            if (i < res->n_segs) flags |= MSG_MORE;
+#endif
+
+            sent = fdwatch_sendmsg(&serv->fdwatch, conn->fd, &msg, flags);
+            if (sent == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    blocked = 1;
+                    break;
+                }
+                res->error = "write_response(): sendmsg() failed";
+                return W_FATAL_ERROR;
+            }
         } else {
-            conn->write_tries_left = 5;
+            // The file goes out behind what the ring is still sending
+            if (fdwatch_send_pending(&serv->fdwatch, conn->fd)) {
+                blocked = 1;
+                break;
+            }
+
+            stream_file(serv, conn, seg->offset);
+
+            // Reading a small segment costs less than probing it, so
+            // it's read without waiting and only goes to the I/O pool
+            // if it isn't cached
+            int nowait = serv->io_idx != 0 && !res->no_probe &&
+                seg->len <= NOWAIT_MAX_SIZE && seg->offset >= res->warm_end;
+
+            len = nowait ? seg->len : get_warm_len(serv, conn, seg);
+            if (len == 0) {
+                if (submit_io(serv, conn, seg) == 0)
+                    return W_WAITING_IO;
+                len = seg->len;
+            }
+
+            if (limited)
+                len = MIN(len, (size_t) conn->deficit);
+
+            Out_Seg part = *seg;
+            part.len = len;
+            if (nowait) {
+                sent = copy_file(conn, &part, 1);
+                if (sent == -1 && errno == EAGAIN) {
+                    if (submit_io(serv, conn, seg) == 0)
+                        return W_WAITING_IO;
+                    sent = write_file(conn, &part);
+                }
+            } else {
+                sent = write_file(conn, &part);
+            }
+            if (sent == -1)
+                return W_FATAL_ERROR;
         }
-    };
 
-    // Unreachable
-    return fulfill(&dq, W_FATAL_ERROR);
+        out_advance(res, sent);
+        if (limited)
+            conn->deficit -= sent;
+
+        // Socket is full
+        if ((size_t) sent < len) {
+            blocked = 1;
+            break;
+        }
+    }
+
+    if (blocked && conn->deficit > 0)
+        conn->deficit = 0;
+
+    if (res->seg_i == res->n_segs) {
+        conn->deficit = 0;
+        return W_COMPLETE_WRITE;
+    }
+
+    // Retry later if not sent at all
+    if (res->nbytes_sent == nbytes_sent && !out_of_turn) {
+        // This only happens when the client has a sudden
+        // disconnection. Retrying later gives the client
+        // some time to regain the connection.
+        if (conn->write_tries_left == 0) {
+            res->error = "write_response(): Max write tries reached";
+            return W_MAX_TRIES;
+        }
+        conn->write_tries_left--;
+    } else if (res->nbytes_sent != nbytes_sent) {
+        conn->write_tries_left = 5;
+    }
+
+    return W_PARTIAL_WRITE;
 }
 
 void
@@ -473,126 +891,200 @@ close_connection(Server *s, nfds_t i)
       with the same fd might close some other file. For more info
       read close(2) manual.
     */
-    if (close(s->queue.pollfds[i].fd) == -1) {
+    Poll_Queue *q = &s->queue;
+    fdwatch_del_fd(&s->fdwatch, q->pollfds[i].fd);
+    if (close(q->pollfds[i].fd) == -1) {
         perror("close()");
     }
 
-    s->queue.conns[i].fd = -1;
-    s->queue.pollfds[i].fd = -1;
-    s->queue.pollfds[i].events = 0;
-    s->queue.pollfds[i].revents = 0;
+    // Invalidate handles to this connection
+    Connection *conn = get_conn(q, i);
+    conn->fd = -1;
+    conn->gen++;
+    q->pollfds[i] = (struct pollfd) { .fd = -1 };
 
-    // Copy last pollfd and conn onto current pollfd and conn
-    if (i != s->queue.n_conns - 1) {
-        s->queue.pollfds[i] = s->queue.pollfds[s->queue.n_conns - 1];
-        s->queue.conns[i] = s->queue.conns[s->queue.n_conns - 1];
-    }
+    q->free_slots[q->n_free++] = i;
+    q->n_live--;
+
+    // Don't make poll() scan free slots at the end of the queue
+    while (q->n_conns > 1 && q->pollfds[q->n_conns - 1].fd == -1)
+        q->n_conns--;
+}
 
-    s->queue.n_conns--;
+long long
+get_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    // Downsize if necessary
-    if (s->queue.n_conns_alloc > 20 &&
-        s->queue.n_conns <= s->queue.n_conns_alloc / 4) {
-        s->queue.n_conns_alloc = MAX(20, s->queue.n_conns_alloc / 2);
-        s->queue.pollfds =
-            xrealloc(s->queue.pollfds,
-                     sizeof(s->queue.pollfds[0]) * s->queue.n_conns_alloc);
-        s->queue.conns =
-            xrealloc(s->queue.conns,
-                 sizeof(s->queue.conns[0]) * s->queue.n_conns_alloc);
+// Gives the connection 'secs' seconds from now until it times
+// out. Deadlines are rounded to timer ticks, so a busy connection
+// touches the timer wheel at most once per tick.
+void
+set_conn_deadline(Server *s, nfds_t i, int secs)
+{
+    Connection *conn = get_conn(&s->queue, i);
+    long long deadline = timer_round_deadline(s->now_ms + secs * 1000LL);
 
-    }
+    conn->last_active = s->time_now;
+    if (deadline == conn->deadline_ms)
+        return;
+
+    conn->deadline_ms = deadline;
+    timer_add(&s->timers, get_conn_handle(conn), deadline);
+}
+
+// Corks the connection while pipelined responses are written, so
+// they go out in full packets instead of one or more each
+void
+set_conn_cork(Connection *conn, int on)
+{
+#ifdef TCP_CORK
+    if (conn->corked == on)
+        return;
+
+    if (setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == -1)
+        perror("setsockopt(TCP_CORK) inside set_conn_cork()");
+    conn->corked = on;
+#else
+    (void) conn; (void) on;
+#endif
 }
 
 void
 recycle_connection(Server *s, nfds_t i)
 {
-    free_http_request(s->queue.conns[i].req);
-    free_http_response(s->queue.conns[i].res);
+    Connection *conn = get_conn(&s->queue, i);
+    reset_http_request(conn->req);
+    shrink_request_buf(s, conn->req);
+    free_http_response(conn->res);
 
-    s->queue.conns[i].req = NULL;
-    s->queue.conns[i].res = NULL;
-    s->queue.conns[i].read_tries_left = 5;
-    s->queue.conns[i].write_tries_left = 5;
-    s->queue.conns[i].keep_alive = 1;
-    s->queue.conns[i].last_active = s->time_now;
+    conn->res = NULL;
+    conn->read_tries_left = 5;
+    conn->write_tries_left = 5;
+    conn->keep_alive = 1;
+    set_conn_deadline(s, i, s->conf.timeout_secs);
 
-    s->queue.pollfds[i].events = POLLIN;
     s->queue.pollfds[i].revents = 0;
 }
 
-// TODO: don't take pollfd pointer, reference it from conn->
 void
-set_conn_state(struct pollfd *pfd, Connection *conn, int state)
+set_conn_state(Server *s, nfds_t i, int state)
 {
-    conn->state = state;
+    struct pollfd *pfd = s->queue.pollfds + i;
+    short events = pfd->events;
+
+    get_conn(&s->queue, i)->state = state;
 
     switch (state) {
     case CONN_STATE_READING:
-        pfd->events = POLLIN;
+        events = POLLIN;
         break;
     case CONN_STATE_WRITING_HEADERS:
     case CONN_STATE_WRITING_BODY:
-        pfd->events = POLLOUT;
+        events = POLLOUT;
+        break;
+    case CONN_STATE_WAITING_IO:
+        // on_io_done() wakes it up
+        events = 0;
+        break;
+    case CONN_STATE_LINGERING:
+        // The ring reports POLLOUT once the response is out, the
+        // write side can't be shut before that
+        events = fdwatch_send_pending(&s->fdwatch, pfd->fd) ?
+            POLLOUT : POLLIN;
         break;
     case CONN_STATE_WRITING_FINISHED:
     case CONN_STATE_CLOSING:
-        pfd->events = 0;
+        // Transient states, do_conn_state() moves on from them
+        // right away, so there's no point in re-arming the fd
         break;
     }
+
+    // Only tell fdwatch when the interest set actually changes
+    if (events != pfd->events) {
+        pfd->events = events;
+        fdwatch_mod_fd(&s->fdwatch, s->queue.pollfds, i);
+    }
 }
 
 // State machine for handling connections
 int
 do_conn_state(Server *serv, nfds_t idx)
 {
-    Connection *conn = &(serv->queue.conns[idx]);
+    Connection *conn = get_conn(&serv->queue, idx);
     struct pollfd *pfd = &(serv->queue.pollfds[idx]);
 
     switch (conn->state) {
 
     case CONN_STATE_READING: {
-        if (!(pfd->revents & POLLIN))
+        // The next pipelined request may be in the buffer already
+        int pipelined = conn->req && conn->req->buf->n_items > 0 &&
+            parse_http_request(conn->req) != P_PARTIAL;
+
+        if (!pipelined) {
+            // Pipeline drained, send what's left of it
+            set_conn_cork(conn, 0);
+            conn->n_chained = 0;
+        }
+
+        if (!pipelined && !(pfd->revents & POLLIN))
             return 0;
 
         // Allocate memory for request struct
         if (conn->req == NULL) {
             conn->req = xmalloc(sizeof(*(conn->req)));
             memset(conn->req, 0, sizeof(*(conn->req)));
-            // We won't grow this buffer
-            conn->req->buf = new_buf(MAX_REQUEST_SIZE);
+            conn->req->buf = new_buf(REQUEST_BUF_SIZE);
         }
 
-        int status = read_request(conn);
+        int was_idle = conn->req->buf->n_items == 0;
+        int status = pipelined ? R_COMPLETE_READ : read_request(serv, conn);
         switch (status) {
 
         case R_PARTIAL_READ:
-            conn->last_active = serv->time_now;
+            // The whole request has to arrive within the read
+            // timeout, no matter how slowly it trickles in
+            if (was_idle && conn->req->buf->n_items > 0)
+                set_conn_deadline(serv, idx, serv->conf.read_timeout_secs);
             break;
 
         case R_FATAL_ERROR:
         case R_CLIENT_CLOSED:
-            set_conn_state(pfd, conn, CONN_STATE_CLOSING);
+            set_conn_state(serv, idx, CONN_STATE_CLOSING);
             do_conn_state(serv, idx);
             break;
 
         case R_REQ_TOO_BIG:
-            // TODO: send 413 error instead
-            set_conn_state(pfd, conn, CONN_STATE_CLOSING);
-            do_conn_state(serv, idx);
+            // Answer and close. The rest of the request is drained
+            // first, closing on unread data would reset the
+            // connection before the client gets the answer.
+            conn->keep_alive = 0;
+            conn->linger = 1;
+            set_conn_deadline(serv, idx, serv->conf.write_timeout_secs);
+            if (conn->req->parse_state == PARSE_REQUEST_LINE) {
+                conn->res = make_error_http_response(
+                    serv, 414, "Error 414: request line too long\n");
+            } else {
+                conn->res = make_error_http_response(
+                    serv, 431, "Error 431: request headers too large\n");
+            }
+            set_conn_state(serv, idx, CONN_STATE_WRITING_HEADERS);
             break;
 
         case R_COMPLETE_READ:
-            conn->last_active = serv->time_now;
-
-            // Reading done, parse request
-            // TODO: turn this into a separate state
-            parse_http_request(conn->req);
+            set_conn_deadline(serv, idx, serv->conf.write_timeout_secs);
 
+            // Reading done, read_request() parsed it already
             print_http_request(stdout, conn->req);
 
             // Parse error
             if (conn->req->error) {
+                // Where the next request starts is anyone's guess
+                conn->keep_alive = 0;
+
                 fprintf(stdout,
                         "Parse error: %s\n",
                         conn->req->error);
@@ -602,36 +1094,66 @@ do_conn_state(Server *serv, nfds_t idx)
 
                 // Close the connection if we didn't manage
                 // to parse the essential headers
-                if (!conn->req->method ||
-                    !conn->req->path ||
-                    !conn->req->host) {
-                    set_conn_state(pfd, conn, CONN_STATE_CLOSING);
+                if (!conn->req->method.len ||
+                    !conn->req->path.len ||
+                    !conn->req->host.len) {
+                    set_conn_state(serv, idx, CONN_STATE_CLOSING);
                     do_conn_state(serv, idx);
                     return 1;
                 }
+
+                // Where the body ends is unknown, so it isn't served.
+                // The body may still be coming, see R_REQ_TOO_BIG.
+                if (conn->req->error_status) {
+                    conn->linger = 1;
+                    conn->res = make_error_http_response(
+                        serv, conn->req->error_status,
+                        conn->req->error_status == 501 ?
+                        "Error 501: transfer coding not implemented\n" :
+                        "Error 400: bad request body framing\n");
+                }
             }
 
             // Set keep-alive
-            if (conn->req->connection &&
-                !strcasecmp(conn->req->connection, "close")) {
+            if (conn->req->must_close ||
+                req_slice_case_eq(conn->req, conn->req->connection,
+                                  "close")) {
                 conn->keep_alive = 0;
             }
 
+            // More requests were sent behind this one
+            if (conn->req->parse_state == PARSE_DONE &&
+                conn->req->buf->n_items > conn->req->head_len)
+                set_conn_cork(conn, 1);
+
             // Start writing
-            set_conn_state(pfd, conn, CONN_STATE_WRITING_HEADERS);
+            set_conn_state(serv, idx, CONN_STATE_WRITING_HEADERS);
+
+            // The socket took all of the previous response, so the
+            // response of a pipelined request goes right behind it
+            if (pipelined && conn->n_chained < PIPELINE_BATCH) {
+                conn->n_chained++;
+                pfd->revents = POLLOUT;
+                do_conn_state(serv, idx);
+            } else if (pipelined) {
+                // Batch done, the rest waits for the next round
+                set_conn_cork(conn, 0);
+                conn->n_chained = 0;
+            }
             break;
         }
         break;
     }
 
-    case CONN_STATE_WRITING_HEADERS: {
+    case CONN_STATE_WRITING_HEADERS:
+    case CONN_STATE_WRITING_BODY: {
         if (!(pfd->revents & POLLOUT))
             return 0;
 
         // Generate response
         if (!conn->res) {
-            conn->last_active = serv->time_now;
-            conn->res = make_http_response(serv, conn->req);
+            conn->res = make_http_response(serv, conn->req,
+                                           conn->keep_alive);
 
             if (serv->conf.verbose) {
                 printf("-----------------\n");
@@ -641,90 +1163,49 @@ do_conn_state(Server *serv, nfds_t idx)
             }
         }
 
-        int status = write_headers(conn);
+        size_t nbytes_sent = conn->res->nbytes_sent;
+        int status = write_response(serv, conn);
+        if (conn->res->nbytes_sent != nbytes_sent)
+            set_conn_deadline(serv, idx, serv->conf.write_timeout_secs);
+
         switch (status) {
+        case W_WAITING_IO:
+            set_conn_state(serv, idx, CONN_STATE_WAITING_IO);
+            return 0;
+
         case W_PARTIAL_WRITE:
-            conn->last_active = serv->time_now;
+            // The head is always the first segment
+            if (conn->state == CONN_STATE_WRITING_HEADERS &&
+                conn->res->seg_i > 0)
+                set_conn_state(serv, idx, CONN_STATE_WRITING_BODY);
             return 0;
 
         case W_MAX_TRIES:
-            if (serv->conf.verbose) {
-                printf("DEB: write_headers() on connection %lud "
-                       "returned W_MAX_TRIES with error \"%s\"\n",
-                       idx, conn->res->error);
-            }
-            set_conn_state(pfd, conn, CONN_STATE_CLOSING);
-            do_conn_state(serv, idx);
-            break;
-
         case W_FATAL_ERROR:
             if (serv->conf.verbose) {
-                printf("DEB: write_headers() on connection %lud "
-                       "returned W_FATAL_ERROR with error \"%s\"\n",
-                       idx, conn->res->error);
+                printf("DEB: write_response() on connection %lud "
+                       "returned %s with error \"%s\"\n",
+                       idx,
+                       status == W_MAX_TRIES ? "W_MAX_TRIES" : "W_FATAL_ERROR",
+                       conn->res->error);
             }
-            set_conn_state(pfd, conn, CONN_STATE_CLOSING);
+            set_conn_state(serv, idx, CONN_STATE_CLOSING);
             do_conn_state(serv, idx);
             break;
 
         case W_COMPLETE_WRITE:
-            if (!strcmp(conn->req->method, "HEAD")) {
-                set_conn_state(pfd, conn, CONN_STATE_WRITING_FINISHED);
-                do_conn_state(serv, idx);
-            } else {
-                set_conn_state(pfd, conn, CONN_STATE_WRITING_BODY);
-                do_conn_state(serv, idx);
-            }
+            set_conn_state(serv, idx, CONN_STATE_WRITING_FINISHED);
+            do_conn_state(serv, idx);
             break;
         }
         break;
     }
 
-    case CONN_STATE_WRITING_BODY: {
-        if (!(pfd->revents & POLLOUT))
-            return 0;
-
-        int write_fn; // If write_body was called, holds 0, otherwise holds 1
-        int status;
-        if (conn->res->body.data) {
-            status = write_body(conn);
-            write_fn = 0;
-        } else {
-            status = write_file(conn);
-            write_fn = 1;
-        }
-        switch (status) {
-        case W_PARTIAL_WRITE:
-            return 0;
-
-        case W_MAX_TRIES:
-            // TODO: print error stuff
-            printf("W_MAX_TRIES\n");
-            set_conn_state(pfd, conn, CONN_STATE_CLOSING);
-            do_conn_state(serv, idx);
-            break;
-
-        case W_FATAL_ERROR:
-            // TODO: print error stuff
-            if (serv->conf.verbose) {
-                if (write_fn == 0) {
-                    printf("ERR: write_file() on connection %lud "
-                           "returned W_FATAL_ERROR with error \"%s\"\n",
-                           idx, conn->res->error);
-                } else {
-                    printf("ERR: write_body() on connection %lud "
-                           "returned W_FATAL_ERROR with error \"%s\"\n",
-                           idx, conn->res->error);
-                }
-            }
-            set_conn_state(pfd, conn, CONN_STATE_CLOSING);
-            do_conn_state(serv, idx);
-            break;
-
-        case W_COMPLETE_WRITE:
-            set_conn_state(pfd, conn, CONN_STATE_WRITING_FINISHED);
+    case CONN_STATE_WAITING_IO: {
+        // Only errors and hangups are reported while waiting
+        if (pfd->revents & (POLLERR | POLLHUP)) {
+            set_conn_state(serv, idx, CONN_STATE_CLOSING);
             do_conn_state(serv, idx);
-            break;
         }
         break;
     }
@@ -732,15 +1213,61 @@ do_conn_state(Server *serv, nfds_t idx)
     case CONN_STATE_WRITING_FINISHED: {
         if (conn->keep_alive) {
             recycle_connection(serv, idx);
-            set_conn_state(pfd, conn, CONN_STATE_READING);
+            set_conn_state(serv, idx, CONN_STATE_READING);
+
+            // Answers the next pipelined request, if there is one
+            do_conn_state(serv, idx);
+        } else if (conn->linger) {
+            set_conn_deadline(serv, idx, LINGER_SECS);
+            set_conn_state(serv, idx, CONN_STATE_LINGERING);
+            do_conn_state(serv, idx);
         } else {
-            set_conn_state(pfd, conn, CONN_STATE_CLOSING);
+            set_conn_state(serv, idx, CONN_STATE_CLOSING);
+            do_conn_state(serv, idx);
+        }
+        break;
+    }
+
+    case CONN_STATE_LINGERING: {
+        if (!conn->shut_wr) {
+            if (fdwatch_send_pending(&serv->fdwatch, conn->fd))
+                return 0;
+
+            // Tells the client the response is all there is
+            if (shutdown(conn->fd, SHUT_WR) == -1) {
+                set_conn_state(serv, idx, CONN_STATE_CLOSING);
+                do_conn_state(serv, idx);
+                break;
+            }
+            conn->shut_wr = 1;
+            set_conn_state(serv, idx, CONN_STATE_LINGERING);
+        }
+
+        // Throw away what the client still sends until it closes
+        // or the deadline hits. A few reads a round, so that a fast
+        // sender doesn't hog the loop.
+        char scratch[REQUEST_BUF_SIZE];
+        for (int i = 0; i < 16; i++) {
+            ssize_t n = fdwatch_recv(&serv->fdwatch, conn->fd,
+                                     scratch, sizeof(scratch));
+            if (n > 0)
+                continue;
+            if (n == -1 &&
+                (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return 0;
+
+            set_conn_state(serv, idx, CONN_STATE_CLOSING);
             do_conn_state(serv, idx);
+            break;
         }
         break;
     }
 
     case CONN_STATE_CLOSING:
+        if (conn->req) {
+            buf_pool_put(&serv->buf_pool, conn->req->buf);
+            conn->req->buf = NULL;
+        }
         free_connection_parts(conn);
         close_connection(serv, idx);
         break;
@@ -752,21 +1279,7 @@ do_conn_state(Server *serv, nfds_t idx)
 void
 serv_add_connection(Server *s, int newsock)
 {
-    int idx = s->queue.n_conns;
-    s->queue.n_conns++;
-
-    // Resize pollfds and conns arrays
-    if (s->queue.n_conns >= s->queue.n_conns_alloc) {
-        s->queue.n_conns_alloc = MIN(
-            s->queue.n_conns_alloc * 2,
-            (nfds_t) s->conf.max_fds);
-        s->queue.pollfds =
-            xrealloc(s->queue.pollfds,
-                 sizeof(s->queue.pollfds[0]) * s->queue.n_conns_alloc);
-        s->queue.conns =
-            xrealloc(s->queue.conns,
-                 sizeof(s->queue.conns[0]) * s->queue.n_conns_alloc);
-    }
+    nfds_t idx = alloc_conn_slot(&s->queue);
 
     // Add pollfd
     s->queue.pollfds[idx] = (struct pollfd) {
@@ -776,26 +1289,422 @@ serv_add_connection(Server *s, int newsock)
     };
 
     // Add connection
-    s->queue.conns[idx] = make_connection(newsock, s, idx);
+    *get_conn(&s->queue, idx) = make_connection(newsock, s, idx);
+    set_conn_deadline(s, idx, s->conf.timeout_secs);
+
+    fdwatch_add_sock_fd(&s->fdwatch, s->queue.pollfds, idx);
 }
 
-int
-main(int argc, char **argv)
+// Called by timer_expire() for every due connection timer
+void
+on_conn_timer(void *ctx, Timer *t)
 {
-    Server serv = {0};
-    Argdef argdefs[9];
-    memset(argdefs, 0, sizeof(argdefs));
-    argdefs[0] = (Argdef) {
-        .short_arg = 'v',
-        .long_arg = "verbose",
-        .type = ARGDEF_TYPE_BOOL,
-    };
-    argdefs[1] = (Argdef) {
-        .short_arg = 'q',
-        .long_arg = "quiet",
-        .type = ARGDEF_TYPE_BOOL,
-    };
-    argdefs[2] = (Argdef) {
+    Server *serv = ctx;
+    Connection *conn = get_conn_by_handle(&serv->queue, t->key);
+
+    // Connection was closed or is the listen socket
+    if (!conn || conn->slot == 0)
+        return;
+    nfds_t idx = conn->slot;
+
+    // Deadline moved since this timer was set
+    if (conn->deadline_ms != t->deadline_ms ||
+        conn->state == CONN_STATE_CLOSING)
+        return;
+
+    // Lingering ends at its deadline, that's no timeout
+    if (conn->state != CONN_STATE_LINGERING)
+        fprintf(stdout, "Connection %ld timed out\n", idx);
+    set_conn_state(serv, idx, CONN_STATE_CLOSING);
+    do_conn_state(serv, idx);
+}
+
+// Long transfers are deferred to the end of the round when small
+// responses go first, see Server_Config.small_first
+static int
+is_bulk_write(Server *serv, Connection *conn)
+{
+    if (serv->conf.small_first == 0 ||
+        conn->state != CONN_STATE_WRITING_BODY)
+        return 0;
+
+    Http_Response *res = conn->res;
+    size_t left = 0;
+    for (int i = res->seg_i; i < res->n_segs; i++)
+        left += res->segs[i].len;
+
+    return left > (size_t) serv->conf.small_first;
+}
+
+// Resumes the connections whose file reads finished
+void
+on_io_done(Server *serv)
+{
+    Io_Job *job = io_pool_take_done(&serv->io_pool);
+
+    while (job) {
+        Io_Job *next = job->next;
+
+        // Connection might have timed out in the meantime
+        Connection *conn = get_conn_by_handle(&serv->queue, job->key);
+        if (conn && conn->state == CONN_STATE_WAITING_IO) {
+            if (job->error == 0) {
+                conn->res->warm_end = job->offset + job->len;
+            } else {
+                // Let write_file() run into the error itself
+                conn->res->no_probe = 1;
+            }
+            set_conn_state(serv, conn->slot,
+                           conn->res->seg_i > 0 ?
+                           CONN_STATE_WRITING_BODY :
+                           CONN_STATE_WRITING_HEADERS);
+        }
+
+        free(job);
+        job = next;
+    }
+}
+
+// Pins the calling thread (or process) to the n-th CPU it's
+// allowed to run on, wrapping around if there are fewer CPUs.
+void
+pin_to_cpu(int n)
+{
+#ifdef CPU_SET
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity() inside pin_to_cpu()");
+        return;
+    }
+
+    int n_cpus = CPU_COUNT(&allowed);
+    if (n_cpus == 0) return;
+    n %= n_cpus;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (n-- > 0) continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1)
+            perror("sched_setaffinity() inside pin_to_cpu()");
+        return;
+    }
+#else
+    (void) n;
+#endif
+}
+
+// Binds, listens and runs the event loop. Only returns on error.
+int
+run_server(Server *serv)
+{
+    if (serv->conf.pin_cpus)
+        pin_to_cpu(serv->worker_id);
+
+    // Init server
+    serv->time_now = time(NULL);
+    serv->now_ms = get_now_ms();
+    timer_wheel_init(&serv->timers, serv->now_ms);
+    fcache_init(&serv->fcache, serv->conf.fcache_entries);
+    buf_pool_init(&serv->buf_pool, REQUEST_BUF_MID_SIZE, REQUEST_BUF_MAX_SIZE);
+    header_cache_init(&serv->headers, serv->conf.timeout_secs);
+
+    // Worker threads share the pid, the worker id tells them apart.
+    // xorshift gets stuck at 0, any other state will do.
+    uint64_t seed = (uint64_t) serv->time_now << 32 ^
+        (uint64_t) getpid() << 16 ^ (uint64_t) serv->worker_id;
+    serv->rand_state = seed * 0x9E3779B97F4A7C15ULL;
+    if (serv->rand_state == 0)
+        serv->rand_state = 1;
+
+    struct addrinfo server_addrinfo = {0};
+    int listen_sock = init_server(&serv->conf, &server_addrinfo);
+    if (listen_sock == -1) {
+        fprintf(stderr, "init_server() failed.\n");
+        return 1;
+    }
+
+    // Start listening
+    if (listen(listen_sock, serv->conf.backlog) == -1) {
+        perror("listen()");
+        return 1;
+    }
+
+    // Only wake up for connections that have sent request bytes
+    if (serv->conf.defer_accept_secs > 0) {
+#ifdef TCP_DEFER_ACCEPT
+        int secs = serv->conf.defer_accept_secs;
+        if (setsockopt(listen_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                       &secs, sizeof(secs)) == -1) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+        }
+#endif
+    }
+
+    // Don't block on listen_sock, accept_new_conn() drains it
+    // until EAGAIN
+    if (fcntl(listen_sock, F_SETFL, O_NONBLOCK) != 0) {
+        perror("fcntl() on listen_sock");
+        return 1;
+    }
+
+    // Preallocate space for connections &  pollfds
+    init_conn_pool(serv);
+
+    // Init fd watcher
+    int backend = fdwatch_init(&serv->fdwatch, serv->conf.engine,
+                               serv->conf.max_fds);
+    if (!serv->conf.quiet && backend != serv->conf.engine) {
+        printf("Engine %s unavailable, falling back to %s\n",
+               fdwatch_backend_name(serv->conf.engine),
+               fdwatch_backend_name(backend));
+    }
+    serv->conf.engine = backend;
+
+    // Add listen_sock to poll queue, it always gets slot 0
+    nfds_t listen_idx = alloc_conn_slot(&serv->queue);
+    serv->queue.pollfds[listen_idx] = (struct pollfd) {
+        .fd = listen_sock,
+        .events = POLLIN,
+        .revents = 0,
+    };
+    // NOTE: This connection won't be used; it's the listen socket
+    *get_conn(&serv->queue, listen_idx) =
+        make_connection(listen_sock, serv, listen_idx);
+    fdwatch_add_listen_fd(&serv->fdwatch, serv->queue.pollfds, listen_idx);
+
+    // Start the I/O pool, its eventfd is watched like a connection
+    serv->io_idx = 0;
+    if (io_pool_init(&serv->io_pool, serv->conf.io_threads) == 0) {
+        serv->io_idx = alloc_conn_slot(&serv->queue);
+        serv->queue.pollfds[serv->io_idx] = (struct pollfd) {
+            .fd = serv->io_pool.efd,
+            .events = POLLIN,
+            .revents = 0,
+        };
+        *get_conn(&serv->queue, serv->io_idx) =
+            make_connection(serv->io_pool.efd, serv, serv->io_idx);
+        fdwatch_add_fd(&serv->fdwatch, serv->queue.pollfds, serv->io_idx);
+    }
+
+    // Main loop
+    while (1) {
+        // Sleep until the next connection deadline at most
+        int nfds = fdwatch(
+            &serv->fdwatch,
+            serv->queue.pollfds,
+            serv->queue.n_conns,
+            timer_next_timeout(&serv->timers, serv->now_ms));
+        serv->time_now = time(NULL);
+        serv->now_ms = get_now_ms();
+
+        if (nfds == -1) {
+            perror("fdwatch() returned -1");
+            return 1;
+        }
+
+        if (serv->conf.verbose) {
+            printf("\n\nSERVER STATE BEFORE ITERATION:\n");
+            print_server_state(serv);
+        }
+
+        // Accept new connections, draining up to accept_batch of
+        // them from the backlog. pollfds[0].fd is the listen_sock
+        if (serv->queue.pollfds[0].revents & POLLIN) {
+            for (int n = 0; n < serv->conf.accept_batch; n++) {
+                if (serv->queue.n_live >= (nfds_t) serv->conf.max_fds) {
+                    fprintf(
+                        stderr,
+                        "poll queue reached maximum capacity of %d\n",
+                        serv->conf.max_fds);
+                    break;
+                }
+
+                // io_uring accepts them in the ring
+                int newsock = fdwatch_accepts(&serv->fdwatch) ?
+                    fdwatch_take_accepted(&serv->fdwatch) :
+                    accept_new_conn(listen_sock, &serv->conf);
+                if (newsock == -1)
+                    break;
+
+                // Update conn queue
+                serv_add_connection(serv, newsock);
+            }
+        }
+
+        // Only walk the connections that have events. Slots don't
+        // move, so closing one doesn't disturb the rest.
+        int n_deferred = 0;
+        for (nfds_t r = 0; r < serv->fdwatch.n_ready; r++) {
+            nfds_t idx = serv->fdwatch.ready[r];
+            if (idx == 0 || idx >= serv->queue.n_conns ||
+                serv->queue.pollfds[idx].fd == -1)
+                continue; // listen_sock or already gone
+
+            if (idx == serv->io_idx) {
+                on_io_done(serv);
+                continue;
+            }
+
+            Connection *conn = get_conn(&serv->queue, idx);
+            if (is_bulk_write(serv, conn)) {
+                conn->deferred = 1;
+                n_deferred++;
+                continue;
+            }
+
+            do_conn_state(serv, idx);
+        }
+
+        // Then the long transfers
+        for (nfds_t r = 0; n_deferred && r < serv->fdwatch.n_ready; r++) {
+            nfds_t idx = serv->fdwatch.ready[r];
+            if (idx == 0 || idx >= serv->queue.n_conns) continue;
+
+            Connection *conn = get_conn(&serv->queue, idx);
+            if (!conn->deferred) continue;
+
+            conn->deferred = 0;
+            n_deferred--;
+            do_conn_state(serv, idx);
+        }
+
+        // Drop timed out connections
+        timer_expire(&serv->timers, serv->now_ms, on_conn_timer, serv);
+
+        if (serv->conf.verbose) {
+            printf("\n\nSERVER STATE AFTER ITERATION:\n");
+            print_server_state(serv);
+        }
+    }
+
+    return 0;
+}
+
+// Forks serv->conf.workers processes, each of which binds its own
+// SO_REUSEPORT socket and runs its own event loop, so the kernel
+// spreads incoming connections across them.
+int
+run_workers(Server *serv)
+{
+    pid_t *pids = xmalloc(sizeof(pid_t) * serv->conf.workers);
+    int n_alive = 0;
+
+    for (int w = 0; w < serv->conf.workers; w++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork() inside run_workers()");
+            break;
+        }
+
+        if (pid == 0) {
+            free(pids);
+            serv->worker_id = w;
+            exit(run_server(serv));
+        }
+
+        pids[w] = pid;
+        n_alive++;
+    }
+
+    if (!serv->conf.quiet)
+        printf("Started %d workers\n", n_alive);
+
+    // Wait for workers. They only exit on errors.
+    while (n_alive > 0) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            perror("wait() inside run_workers()");
+            break;
+        }
+
+        n_alive--;
+        for (int w = 0; w < serv->conf.workers; w++) {
+            if (pids[w] != pid) continue;
+            fprintf(stderr, "Worker %d (pid %d) exited with status %d\n",
+                    w, (int) pid,
+                    WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        }
+    }
+
+    free(pids);
+    return 1;
+}
+
+static void*
+run_server_thread(void *arg)
+{
+    Server *serv = arg;
+    intptr_t ret = run_server(serv);
+    return (void*) ret;
+}
+
+/*
+  Runs serv->conf.workers threads in this process. Nothing is
+  shared between them on the request path: each thread gets its
+  own copy of the Server with its own listen socket, connection
+  table and fdwatch, and the allocations it makes stay in its
+  own malloc arena.
+*/
+int
+run_worker_threads(Server *serv)
+{
+    int n = serv->conf.workers;
+    Server *servs = xmalloc(sizeof(Server) * n);
+    pthread_t *tids = xmalloc(sizeof(pthread_t) * n);
+    int n_started = 0;
+
+    for (int w = 0; w < n; w++) {
+        servs[w] = *serv;
+        servs[w].worker_id = w;
+
+        int err = pthread_create(tids + w, NULL, run_server_thread, servs + w);
+        if (err) {
+            fprintf(stderr, "pthread_create() failed: %s\n", strerror(err));
+            break;
+        }
+        n_started++;
+    }
+
+    if (!serv->conf.quiet)
+        printf("Started %d worker threads\n", n_started);
+
+    // Wait for workers. They only exit on errors.
+    for (int w = 0; w < n_started; w++) {
+        void *ret;
+        pthread_join(tids[w], &ret);
+        fprintf(stderr, "Worker thread %d exited with status %d\n",
+                w, (int) (intptr_t) ret);
+    }
+
+    free(tids);
+    free(servs);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    Server serv = {0};
+    Argdef argdefs[26];
+    memset(argdefs, 0, sizeof(argdefs));
+    argdefs[0] = (Argdef) {
+        .short_arg = 'v',
+        .long_arg = "verbose",
+        .type = ARGDEF_TYPE_BOOL,
+    };
+    argdefs[1] = (Argdef) {
+        .short_arg = 'q',
+        .long_arg = "quiet",
+        .type = ARGDEF_TYPE_BOOL,
+    };
+    argdefs[2] = (Argdef) {
         .short_arg = 'u',
         .long_arg = "unsafe",
         .type = ARGDEF_TYPE_BOOL,
@@ -829,8 +1738,95 @@ main(int argc, char **argv)
         // file/directory to serve
         .type = ARGDEF_TYPE_RAW,
     };
+    argdefs[9] = (Argdef) {
+        // poll, epoll or io_uring
+        .short_arg = 'E',
+        .long_arg = "engine",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[10] = (Argdef) {
+        .short_arg = 'w',
+        .long_arg = "workers",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[11] = (Argdef) {
+        .short_arg = 't',
+        .long_arg = "threads",
+        .type = ARGDEF_TYPE_BOOL,
+    };
+    argdefs[12] = (Argdef) {
+        .long_arg = "pin",
+        .type = ARGDEF_TYPE_BOOL,
+    };
+
+    argdefs[13] = (Argdef) {
+        .long_arg = "accept-batch",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[14] = (Argdef) {
+        .long_arg = "backlog",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[15] = (Argdef) {
+        .long_arg = "defer-accept",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[16] = (Argdef) {
+        .long_arg = "nodelay",
+        .type = ARGDEF_TYPE_BOOL,
+    };
+
+    argdefs[17] = (Argdef) {
+        .long_arg = "sndbuf",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[18] = (Argdef) {
+        .long_arg = "rcvbuf",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[19] = (Argdef) {
+        .long_arg = "notsent-lowat",
+        .type = ARGDEF_TYPE_STRING,
+    };
 
-    int parse_ok = parse_args(argc, argv, 9, argdefs);
+    argdefs[20] = (Argdef) {
+        .long_arg = "fd-cache",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[21] = (Argdef) {
+        .long_arg = "io-threads",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[22] = (Argdef) {
+        .long_arg = "stream-size",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[23] = (Argdef) {
+        .long_arg = "write-quantum",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[24] = (Argdef) {
+        .long_arg = "small-first",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    argdefs[25] = (Argdef) {
+        .long_arg = "max-request-size",
+        .type = ARGDEF_TYPE_STRING,
+    };
+
+    int parse_ok = parse_args(argc, argv, 26, argdefs);
     if (!parse_ok) {
         printf("Error parsing arguments\n");
         return 1;
@@ -852,111 +1848,102 @@ main(int argc, char **argv)
             (argdefs[7].value ? argdefs[7].value : "index.html")
             : NULL,
         .serve_path = argdefs[8].value ? argdefs[8].value : "./",
-        .timeout_secs     = 20,
-        .poll_interval_ms = 1000,
+        .timeout_secs       = 20,
+        .read_timeout_secs  = 20,
+        .write_timeout_secs = 20,
         .max_fds = fdwatch_get_max_poll_nfds(),
+        .engine = FDWATCH_EPOLL,
+        .workers = argdefs[10].value ? atoi(argdefs[10].value) : 1,
+        .threads = argdefs[11].bvalue,
+        .pin_cpus = argdefs[12].bvalue,
+        .accept_batch = argdefs[13].value ? atoi(argdefs[13].value) : 64,
+        .backlog = argdefs[14].value ? atoi(argdefs[14].value) : SOMAXCONN,
+        .defer_accept_secs = argdefs[15].value ? atoi(argdefs[15].value) : 5,
+        .nodelay = argdefs[16].bvalue,
+        .sndbuf = argdefs[17].value ? atoi(argdefs[17].value) : 0,
+        .rcvbuf = argdefs[18].value ? atoi(argdefs[18].value) : 0,
+        .notsent_lowat = argdefs[19].value ? atoi(argdefs[19].value) : 0,
+        .fcache_entries = argdefs[20].value ?
+            atoi(argdefs[20].value) : FCACHE_DEFAULT_MAX_ENTRIES,
+        .io_threads = argdefs[21].value ?
+            atoi(argdefs[21].value) : IO_POOL_DEFAULT_THREADS,
+        .stream_min_size = argdefs[22].value ?
+            atoll(argdefs[22].value) : STREAM_DEFAULT_MIN_SIZE,
+        .write_quantum = argdefs[23].value ?
+            atoi(argdefs[23].value) : DEFAULT_WRITE_QUANTUM,
+        .small_first = argdefs[24].value ? atoi(argdefs[24].value) : 0,
+        .max_request_size = argdefs[25].value ?
+            atoi(argdefs[25].value) : REQUEST_BUF_MAX_SIZE,
     };
 
-    // Set chroot directory
-    if (serv.conf.chroot && serv.conf.chroot_dir == NULL) {
-        serv.conf.chroot_dir = serv.conf.serve_path;
+    if (serv.conf.max_request_size < REQUEST_BUF_SIZE ||
+        serv.conf.max_request_size > REQUEST_BUF_MAX_SIZE) {
+        printf("Max request size must be between %d and %d\n",
+               REQUEST_BUF_SIZE, REQUEST_BUF_MAX_SIZE);
+        return 1;
     }
 
-    // Print server configuration
-    if (!serv.conf.quiet) print_server_config(&serv.conf);
-
-    // Init server
-    serv.time_now = time(NULL);
-    struct addrinfo server_addrinfo = {0};
-    int listen_sock = init_server(serv.conf.port, &server_addrinfo);
-    if (listen_sock == -1) {
-        fprintf(stderr, "init_server() failed.\n");
+    if (serv.conf.write_quantum < 0 || serv.conf.small_first < 0) {
+        printf("Write quantum and small-first size can't be negative\n");
         return 1;
     }
 
-    // Print server LAN addresses
-    print_server_lan_addr(serv.conf.port);
+    if (serv.conf.stream_min_size < 0) {
+        printf("Stream size can't be negative\n");
+        return 1;
+    }
 
-    // Start listening
-    int backlog = 10;
-    if (listen(listen_sock, backlog) == -1) {
-        perror("listen()");
+    if (serv.conf.fcache_entries < 0) {
+        printf("File cache size can't be negative\n");
         return 1;
     }
 
-    // Preallocate space for connections &  pollfds
-    init_conn_pool(&serv);
+    if (serv.conf.backlog < 1) {
+        printf("Listen backlog must be at least 1\n");
+        return 1;
+    }
 
-    // Add listen_sock to poll queue
-    serv.queue.pollfds[0] = (struct pollfd) {
-        .fd = listen_sock,
-        .events = POLLIN,
-        .revents = 0,
-    };
-    serv.queue.n_conns = 1;
-    // NOTE: This connection won't be used; it's the listen socket
-    serv.queue.conns[0] = make_connection(listen_sock, &serv, 0);
+    if (serv.conf.accept_batch < 1) {
+        printf("Accept batch size must be at least 1\n");
+        return 1;
+    }
 
-    // Main loop
-    while (1) {
-        serv.time_now = time(NULL);
-        int nfds = poll(
-            serv.queue.pollfds,
-            serv.queue.n_conns,
-            serv.conf.poll_interval_ms);
+    if (serv.conf.workers < 1) {
+        printf("Number of workers must be at least 1\n");
+        return 1;
+    }
 
-        if (nfds == -1) {
-            perror("poll() returned -1");
+    if (argdefs[9].value) {
+        serv.conf.engine = fdwatch_backend_from_name(argdefs[9].value);
+        if (!serv.conf.engine) {
+            printf("Unknown engine \"%s\", expected one of: "
+                   "poll, epoll, io_uring\n", argdefs[9].value);
             return 1;
         }
+    }
 
-        if (serv.conf.verbose) {
-            printf("\n\nSERVER STATE BEFORE ITERATION:\n");
-            print_server_state(&serv);
-        }
-
-        // Accept new connection
-        // pollfds[0].fd is the listen_sock
-        if (serv.queue.pollfds[0].revents & POLLIN) {
-            if (serv.queue.n_conns >= (nfds_t) serv.conf.max_fds) {
-                fprintf(
-                    stderr,
-                    "poll queue reached maximum capacity of %d\n",
-                    serv.conf.max_fds);
-            } else {
-                int newsock = accept_new_conn(listen_sock);
-                if (newsock != -1) {
-                    // Update conn queue
-                    serv_add_connection(&serv, newsock);
-
-                    // Restart loop to prioritize new connections
-                    continue;
-                }
-            }
-        }
+    // Set chroot directory
+    if (serv.conf.chroot && serv.conf.chroot_dir == NULL) {
+        serv.conf.chroot_dir = serv.conf.serve_path;
+    }
 
-        // Iterate conn/pollfd queue (starts from 1, skipping listen_sock)
-        for (nfds_t idx = 1; idx < serv.queue.n_conns; idx++) {
-            Connection *conn = &(serv.queue.conns[idx]);
+    // Print server configuration
+    if (!serv.conf.quiet) print_server_config(&serv.conf);
 
-            // Drop connection if it timed out
-            if ((conn->state != CONN_STATE_CLOSING) &&
-                (conn->last_active + serv.conf.timeout_secs
-                   <= serv.time_now)) {
-                fprintf(stdout, "Connection %ld timed out\n", idx);
-                conn->state = CONN_STATE_CLOSING;
-            }
+    // Print server LAN addresses
+    print_server_lan_addr(serv.conf.port);
 
-            do_conn_state(&serv, idx);
-        }
+    // A client hanging up mid-response makes send() and sendfile()
+    // fail with EPIPE, which write_*() already handle
+    signal(SIGPIPE, SIG_IGN);
 
-        if (serv.conf.verbose) {
-            printf("\n\nSERVER STATE AFTER ITERATION:\n");
-            print_server_state(&serv);
-        }
+    if (serv.conf.workers > 1) {
+        if (serv.conf.threads)
+            return run_worker_threads(&serv);
+        return run_workers(&serv);
     }
 
-    return 0;
+    return run_server(&serv);
 }
 
 // Get internet address (sin_addr or sin6_addr) from sockaddr
@@ -983,7 +1970,7 @@ get_in_port(struct sockaddr *sa)
 // Calls socket(), setsockopt() and then bind().
 // Returns socket file descriptor on success, -1 on error.
 int
-sockbind(struct addrinfo *ai)
+sockbind(struct addrinfo *ai, Server_Config *conf)
 {
     int s = socket(ai->ai_family,    // AF_INET or AF_INET6
                    ai->ai_socktype,  // SOCK_STREAM
@@ -1003,6 +1990,29 @@ sockbind(struct addrinfo *ai)
         return -1;
     }
 
+    // Let every worker bind its own socket to the same port
+    if (conf->workers > 1) {
+#ifdef SO_REUSEPORT
+        status = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+        if (status == -1) {
+            perror("setsockopt(SO_REUSEPORT) inside sockbind()");
+            close(s);
+            return -1;
+        }
+#else
+        fprintf(stderr, "SO_REUSEPORT is not supported on this system\n");
+        close(s);
+        return -1;
+#endif
+    }
+
+    // Buffer sizes have to be set before listen() to take effect
+    // on the window scaling of accepted connections
+    if (set_sock_opts(s, conf) == -1) {
+        close(s);
+        return -1;
+    }
+
     status = bind(s, ai->ai_addr, ai->ai_addrlen);
     if (status == -1) {
         perror("bind() inside sockbind()");
@@ -1013,6 +2023,49 @@ sockbind(struct addrinfo *ai)
     return s;
 }
 
+// Sets the per-connection socket options from conf. Zero values
+// keep the system defaults. Returns 0 on success, -1 on error.
+int
+set_sock_opts(int s, Server_Config *conf)
+{
+    if (conf->nodelay) {
+        int one = 1;
+        if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+            perror("setsockopt(TCP_NODELAY)");
+            return -1;
+        }
+    }
+
+    if (conf->sndbuf > 0) {
+        if (setsockopt(s, SOL_SOCKET, SO_SNDBUF,
+                       &conf->sndbuf, sizeof(conf->sndbuf)) == -1) {
+            perror("setsockopt(SO_SNDBUF)");
+            return -1;
+        }
+    }
+
+    if (conf->rcvbuf > 0) {
+        if (setsockopt(s, SOL_SOCKET, SO_RCVBUF,
+                       &conf->rcvbuf, sizeof(conf->rcvbuf)) == -1) {
+            perror("setsockopt(SO_RCVBUF)");
+            return -1;
+        }
+    }
+
+    if (conf->notsent_lowat > 0) {
+#ifdef TCP_NOTSENT_LOWAT
+        if (setsockopt(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                       &conf->notsent_lowat,
+                       sizeof(conf->notsent_lowat)) == -1) {
+            perror("setsockopt(TCP_NOTSENT_LOWAT)");
+            return -1;
+        }
+#endif
+    }
+
+    return 0;
+}
+
 // Return number of bytes sent or -1 on error
 int
 send_buf(int sock, char *buf, size_t len)
@@ -1041,7 +2094,7 @@ send_buf(int sock, char *buf, size_t len)
     // removing the one below, it's still wise to have one
     // outside this function.
     for (nbytes_sent = 0; nbytes_sent < len;) {
-        int sent = send(sock, buf, len, 0);
+        int sent = send(sock, buf + nbytes_sent, len - nbytes_sent, 0);
         int saved_errno = errno;
         if (sent == -1) {
             switch (saved_errno) {
@@ -1067,12 +2120,45 @@ send_buf(int sock, char *buf, size_t len)
     return nbytes_sent;
 }
 
-// TODO: use sendfile() if available
-// TODO: reuse the fd on the file struct
-int
-send_file(int sock, File *f, size_t len)
+/*
+  Sends len bytes of fd starting at *offset with sendfile(2) and
+  advances *offset past them. Returns the number of bytes sent,
+  which is less than len once the socket is full, or -1 on error.
+  errno is EINVAL or ENOSYS when sendfile() can't be used for fd
+  and the caller should copy the file instead.
+*/
+ssize_t
+send_file(int sock, int fd, off_t *offset, size_t len)
 {
+#ifdef __linux__
+    size_t nbytes_sent = 0;
+
+    while (nbytes_sent < len) {
+        ssize_t sent = sendfile(sock, fd, offset, len - nbytes_sent);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            // Report the error on the next call
+            if (nbytes_sent > 0) break;
+            return -1;
+        }
+
+        // File shrank since we stat()ed it
+        if (sent == 0) {
+            if (nbytes_sent > 0) break;
+            errno = EIO;
+            return -1;
+        }
+
+        nbytes_sent += sent;
+    }
+
+    return nbytes_sent;
+#else
+    (void) sock; (void) fd; (void) offset; (void) len;
+    errno = ENOSYS;
     return -1;
+#endif
 }
 
 void
@@ -4,9 +4,16 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <poll.h>
+#include <stdint.h>
 #include <time.h>
 #include "dir.h"
 #include "buffer.h"
+#include "fdwatch.h"
+#include "timer.h"
+#include "fcache.h"
+#include "iopool.h"
+#include "bufpool.h"
+#include "headers.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
@@ -19,58 +26,137 @@
 #define CONN_STATE_WRITING_BODY     3
 #define CONN_STATE_WRITING_FINISHED 4
 #define CONN_STATE_CLOSING          5
-
-#define MAX_REQUEST_SIZE               1<<12
+#define CONN_STATE_WAITING_IO       6
+#define CONN_STATE_LINGERING        7
+
+// How long the input is drained after an error response before the
+// socket is closed, see CONN_STATE_LINGERING
+#define LINGER_SECS 2
+
+#define PARSE_REQUEST_LINE 0
+#define PARSE_HEADERS      1
+#define PARSE_BODY         2
+#define PARSE_DONE         3
+
+// Every request starts in a small buffer, bigger heads move to
+// pooled ones, up to Server_Config.max_request_size
+#define REQUEST_BUF_SIZE               (1 << 12)
+#define REQUEST_BUF_MID_SIZE           (1 << 14)
+#define REQUEST_BUF_MAX_SIZE           (1 << 16)
 #define RESPONSE_HEADERS_BUF_INIT_SIZE 1<<12
 #define RESPONSE_BODY_BUF_INIT_SIZE    1<<12
 
+#define CONN_CHUNK_SIZE 256
+
+// A piece of the request buffer, see req_slice(). Offsets instead
+// of pointers, so they stay valid wherever the buffer lives. len is
+// 0 when the field wasn't given.
+typedef struct {
+    size_t offset;
+    size_t len;
+} Http_Slice;
+
+// Ranges taken from a Range header, more and it's ignored
+#define RANGES_MAX 16
+
+// A range as given in a Range header, -1 for a missing bound, so
+// bytes=-500 (the last 500 bytes) is { -1, 500 }. After
+// resolve_ranges() both are offsets and last is inclusive.
+typedef struct {
+    off_t first;
+    off_t last;
+} Http_Range;
+
 typedef struct {
     Buffer *buf;
-    char *method;
-    char *path;
-    char *version_number;
-    //char *query;
-    char *host;
-    char *user_agent;
-    char *accept;
-    char *connection;
+    Http_Slice method;
+    Http_Slice path;
+    Http_Slice version_number;
+    //Http_Slice query;
+    Http_Slice host;
+    Http_Slice user_agent;
+    Http_Slice accept;
+    Http_Slice connection;
     char *error;
 
-    int range_start_given;
-    off_t range_start;
+    Http_Range ranges[RANGES_MAX];
+    int n_ranges; // 0 without a valid Range header
 
-    int range_end_given;
-    off_t range_end;
+    int content_length_given;
+    off_t content_length;
+    int chunked; // Transfer-Encoding: chunked
+    int must_close; // the body framing is suspect, see RFC 9112 6.3
+    int error_status; // answer to a body framing error, 400 or 501
+
+    // Body framing, see parse_http_body()
+    int body_state; // BODY_*
+    off_t body_left; // of the body or the current chunk
+
+    // Parser position, see parse_http_request()
+    int parse_state; // PARSE_*
+    size_t parse_pos; // start of the line being parsed
+    size_t scan_pos;  // its LF is searched for from here
+    size_t head_len;  // request line and headers, once PARSE_DONE
 } Http_Request;
 
+#define OUT_SEG_MEM  1
+#define OUT_SEG_FILE 2
+#define OUT_SEGS_MAX (2 * RANGES_MAX + 2) // head, parts, last boundary
+
+// A piece of a response waiting to be sent. It's consumed from the
+// front as it's sent, so data/offset and len are always what's left.
 typedef struct {
-    Buffer head;
-    size_t head_nbytes_sent;
+    int type;     // OUT_SEG_MEM or OUT_SEG_FILE
+    char *data;   // OUT_SEG_MEM
+    off_t offset; // OUT_SEG_FILE, offset in res->file
+    size_t len;
+} Out_Seg;
 
+typedef struct {
+    Buffer head;
     Buffer body;
-    size_t body_nbytes_sent;
 
     File file;
-    off_t file_offset;
-    size_t file_nbytes_sent;
     char *file_path;
+    int no_sendfile; // sendfile() failed, copy the file instead
+    Fcache_Entry *fcache_entry; // owns file.fd when set
+    off_t warm_end; // file bytes before this are in the page cache
+    int no_probe;   // can't tell what's in the page cache
+
+    // Streaming of large files, see stream_file()
+    size_t ra_window;  // 0 until streaming starts
+    off_t ra_end;      // readahead was issued up to here
+    long long ra_ms;   // when it was last issued
+    off_t dropped_end; // sent pages before this were dropped
+    Fcache_Reader reader; // sent_end is set once streaming starts
+    int is_reader; // reader is in fcache_entry's readers
+
+    // Ranges of the file to send, 0 for all of it or the body. With
+    // more than one, parts has the multipart/byteranges part heads
+    // and the closing boundary. The i-th part head ends at
+    // part_ends[i] and starts where the one before it ends.
+    Http_Range ranges[RANGES_MAX];
+    int n_ranges;
+    Buffer parts;
+    size_t part_ends[RANGES_MAX];
 
     /*
-      The difference between file_offset and range_start is that
-      file_offset tracks the point from which data transfer must
-      continue on each send cycle and thus changes each time a
-      chunk is sent, whereas range_start doesn't change and only
-      defines the initial offset from the start of the file.
+      The output queue. queue_http_response() fills it with the
+      head and whichever of body or file is sent, write_response()
+      sends it and advances seg_i past the finished segments.
     */
-    off_t range_start;
-    off_t range_end;
+    Out_Seg segs[OUT_SEGS_MAX];
+    int n_segs;
+    int seg_i;
+    size_t nbytes_sent;
 
     char *error;
 } Http_Response;
 
 typedef struct {
     int fd;
-    struct pollfd *pollfd;
+    nfds_t slot;  // index in the Poll_Queue, doesn't change
+    unsigned gen; // bumped every time the slot is freed
     Http_Request *req;
     Http_Response *res;
     int read_tries_left; // read_request tries left until force closing
@@ -78,13 +164,31 @@ typedef struct {
     int keep_alive;
     int state;
     time_t last_active;
+    long long deadline_ms; // see set_conn_deadline()
+    long long deficit; // bytes it may still send, see write_response()
+    int deferred;      // served after the small responses this round
+    int n_chained; // pipelined responses written back to back
+    int corked;    // TCP_CORK is set, see set_conn_cork()
+    int linger;    // drain the unread request before closing
+    int shut_wr;   // the write side is shut, see CONN_STATE_LINGERING
 } Connection;
 
+/*
+  Connections live in slots that don't move while they're in use.
+  Connection structs are allocated in chunks of CONN_CHUNK_SIZE that
+  are never reallocated, so pointers to them stay valid. pollfds has
+  to be contiguous for poll(), so it grows a chunk at a time too, but
+  is only ever indexed by slot. Freed slots go on the free_slots
+  stack and get reused before the queue grows.
+*/
 typedef struct {
     struct pollfd *pollfds;
-    Connection *conns;
-    nfds_t n_conns;
-    nfds_t n_conns_alloc;
+    Connection **conn_chunks;
+    nfds_t n_conns;       // slots [0, n_conns) may be in use
+    nfds_t n_conns_alloc; // multiple of CONN_CHUNK_SIZE
+    nfds_t n_live;        // slots in use, listen_sock included
+    nfds_t *free_slots;
+    nfds_t n_free;
 } Poll_Queue;
 
 typedef struct {
@@ -93,9 +197,27 @@ typedef struct {
     int unsafe;
     int chroot;
     int serve_error_files;
-    int timeout_secs;
-    int poll_interval_ms;
+    int timeout_secs;       // idle keep-alive connections
+    int read_timeout_secs;  // to receive a whole request
+    int write_timeout_secs; // without any progress on the response
     int max_fds;
+    int engine;   // FDWATCH_POLL, FDWATCH_EPOLL or FDWATCH_URING
+    int workers;  // number of worker processes or threads
+    int threads;  // run workers as threads instead of processes
+    int pin_cpus; // pin each worker to its own CPU
+    int accept_batch; // max connections accepted per wakeup
+    int backlog; // listen() backlog
+    int defer_accept_secs; // TCP_DEFER_ACCEPT, 0 to disable
+    int nodelay; // set TCP_NODELAY on connections
+    int sndbuf; // SO_SNDBUF, 0 for system default
+    int rcvbuf; // SO_RCVBUF, 0 for system default
+    int notsent_lowat; // TCP_NOTSENT_LOWAT, 0 for system default
+    int fcache_entries; // max open files cached, 0 to disable
+    int io_threads; // threads reading cold files, 0 to disable
+    off_t stream_min_size; // files streamed from this size, 0 to disable
+    int write_quantum; // bytes sent per connection per round, 0 for no limit
+    int small_first; // responses with less left go first, 0 to disable
+    int max_request_size; // longest request head taken
     char *serve_path;
     char *port;
     char *index;  // TODO: replace with array of strings 'index_list'
@@ -106,7 +228,17 @@ typedef struct {
 typedef struct {
     Server_Config conf;
     Poll_Queue queue;
+    Fdwatch fdwatch;
+    int worker_id; // also the CPU to pin to, see pin_to_cpu()
+    Timer_Wheel timers;
+    Fcache fcache;
+    Io_Pool io_pool;
+    nfds_t io_idx; // slot of io_pool.efd, 0 without a pool
+    Buf_Pool buf_pool; // request buffers for big heads
+    Header_Cache headers;
+    uint64_t rand_state; // multipart boundaries, see next_random()
     time_t time_now;
+    long long now_ms; // monotonic
     int sock;
     char ip[INET6_ADDRSTRLEN];
     struct addrinfo addrinfo;
@@ -0,0 +1,132 @@
+// scan - vectorised scanning of request bytes
+
+#include <stddef.h>
+#include "scan.h"
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define P SCAN_PATH_CHAR
+#define H SCAN_HEADER_CHAR
+
+const unsigned char scan_char_class[256] = {
+    ['!'] = P, ['$'] = P, ['%'] = P, ['&'] = P, ['\''] = P, ['('] = P,
+    [')'] = P, ['*'] = P, ['+'] = P, [','] = P, ['-'] = P|H, ['.'] = P,
+    ['/'] = P, ['0'] = P, ['1'] = P, ['2'] = P, ['3'] = P, ['4'] = P,
+    ['5'] = P, ['6'] = P, ['7'] = P, ['8'] = P, ['9'] = P, [':'] = P,
+    [';'] = P, ['='] = P, ['?'] = P, ['@'] = P, ['A'] = P|H,
+    ['B'] = P|H, ['C'] = P|H, ['D'] = P|H, ['E'] = P|H, ['F'] = P|H,
+    ['G'] = P|H, ['H'] = P|H, ['I'] = P|H, ['J'] = P|H, ['K'] = P|H,
+    ['L'] = P|H, ['M'] = P|H, ['N'] = P|H, ['O'] = P|H, ['P'] = P|H,
+    ['Q'] = P|H, ['R'] = P|H, ['S'] = P|H, ['T'] = P|H, ['U'] = P|H,
+    ['V'] = P|H, ['W'] = P|H, ['X'] = P|H, ['Y'] = P|H, ['Z'] = P|H,
+    ['_'] = P, ['a'] = P|H, ['b'] = P|H, ['c'] = P|H, ['d'] = P|H,
+    ['e'] = P|H, ['f'] = P|H, ['g'] = P|H, ['h'] = P|H, ['i'] = P|H,
+    ['j'] = P|H, ['k'] = P|H, ['l'] = P|H, ['m'] = P|H, ['n'] = P|H,
+    ['o'] = P|H, ['p'] = P|H, ['q'] = P|H, ['r'] = P|H, ['s'] = P|H,
+    ['t'] = P|H, ['u'] = P|H, ['v'] = P|H, ['w'] = P|H, ['x'] = P|H,
+    ['y'] = P|H, ['z'] = P|H, ['~'] = P,
+};
+
+#undef P
+#undef H
+
+// Returns the first byte in [p, end) that is a or b
+char*
+scan_for(char *p, char *end, char a, char b)
+{
+#ifdef __AVX2__
+    __m256i va32 = _mm256_set1_epi8(a);
+    __m256i vb32 = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((__m256i*) p);
+        unsigned m = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, va32),
+                            _mm256_cmpeq_epi8(x, vb32)));
+        if (m) return p + __builtin_ctz(m);
+        p += 32;
+    }
+#endif
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((__m128i*) p);
+        unsigned m = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+        if (m) return p + __builtin_ctz(m);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != a && *p != b)
+        p++;
+    return p;
+}
+
+// Returns the first control, space or non-ASCII byte. Those end
+// every token of a request.
+static char*
+scan_token_end(char *p, char *end)
+{
+#ifdef __AVX2__
+    // Signed compare, so bytes >= 0x80 count as below '!' too
+    __m256i bang32 = _mm256_set1_epi8('!');
+    __m256i del32 = _mm256_set1_epi8(0x7F);
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((__m256i*) p);
+        unsigned m = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpgt_epi8(bang32, x),
+                            _mm256_cmpeq_epi8(x, del32)));
+        if (m) return p + __builtin_ctz(m);
+        p += 32;
+    }
+#endif
+#ifdef __SSE2__
+    __m128i bang = _mm_set1_epi8('!');
+    __m128i del = _mm_set1_epi8(0x7F);
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((__m128i*) p);
+        unsigned m = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmplt_epi8(x, bang), _mm_cmpeq_epi8(x, del)));
+        if (m) return p + __builtin_ctz(m);
+        p += 16;
+    }
+#endif
+    while (p < end && (unsigned char) *p > ' ' && (unsigned char) *p < 0x7F)
+        p++;
+    return p;
+}
+
+// Returns the first byte in [p, t) that isn't of class c, or t. The
+// common case of all bytes being fine is checked without branching.
+static char*
+scan_class(char *p, char *t, unsigned char c)
+{
+    unsigned char all = c;
+    for (char *q = p; q < t; q++)
+        all &= scan_char_class[(unsigned char) *q];
+    if (all)
+        return t;
+
+    while (scan_char_class[(unsigned char) *p] & c)
+        p++;
+    return p;
+}
+
+// Returns the first byte that can't be part of a request path
+char*
+scan_path(char *p, char *end)
+{
+    // Token ends are never path chars, so checking up to the token
+    // end covers the whole path
+    return scan_class(p, scan_token_end(p, end), SCAN_PATH_CHAR);
+}
+
+// Returns the first byte that can't be part of a header name
+char*
+scan_header_name(char *p, char *end)
+{
+    // ':' and '\r' aren't header name chars either
+    return scan_class(p, scan_for(p, end, ':', '\r'), SCAN_HEADER_CHAR);
+}
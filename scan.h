@@ -0,0 +1,20 @@
+#ifndef _MIMINO_SCAN_H
+#define _MIMINO_SCAN_H
+
+/*
+  Scanners for the request parser. They look at 16 (SSE2) or 32
+  (AVX2) bytes at a time where the compiler targets those, and fall
+  back to plain loops otherwise. All of them return 'end' when they
+  don't find what they're looking for, and never read past it.
+*/
+
+#define SCAN_PATH_CHAR   1 // valid in a request path
+#define SCAN_HEADER_CHAR 2 // valid in a header name
+
+extern const unsigned char scan_char_class[256];
+
+char* scan_for(char *p, char *end, char a, char b);
+char* scan_path(char *p, char *end);
+char* scan_header_name(char *p, char *end);
+
+#endif // _MIMINO_SCAN_H
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "esma.h"
+#include "bufpool.h"
+
+void
+test_buf_pool()
+{
+    esma_log_test("buf_pool_get()");
+
+    esma_log_subtest("Picks the smallest tier that fits");
+    {
+        Buf_Pool p;
+        buf_pool_init(&p, 16, 64);
+        Buffer *a = buf_pool_get(&p, 5);
+        Buffer *b = buf_pool_get(&p, 17);
+        esma_assert(a && a->n_alloc == 16 && a->n_items == 0);
+        esma_assert(b && b->n_alloc == 64);
+        esma_assert(buf_pool_get(&p, 65) == NULL);
+        free_buf(a);
+        free_buf(b);
+    }
+
+    esma_log_subtest("Reuses returned buffers, frees others");
+    {
+        Buf_Pool p;
+        buf_pool_init(&p, 16, 64);
+        Buffer *a = buf_pool_get(&p, 64);
+        a->n_items = 10;
+        buf_pool_put(&p, a);
+        esma_assert(p.n_free[1] == 1);
+        esma_assert(buf_pool_get(&p, 20) == a);
+        esma_assert(a->n_items == 0);
+        esma_assert(p.n_free[1] == 0);
+
+        // Not a tier size
+        buf_pool_put(&p, new_buf(32));
+        esma_assert(p.n_free[0] == 0 && p.n_free[1] == 0);
+
+        for (int i = 0; i < BUF_POOL_KEEP + 1; i++)
+            buf_pool_put(&p, new_buf(16));
+        esma_assert(p.n_free[0] == BUF_POOL_KEEP);
+
+        buf_pool_put(&p, a);
+        free_buf_pool_parts(&p);
+        esma_assert(p.n_free[0] == 0 && p.n_free[1] == 0);
+    }
+}
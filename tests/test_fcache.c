@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "esma.h"
+#include "fcache.h"
+
+static int
+put_file(Fcache *c, char *path, long long now_ms, Fcache_Entry **e)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) return 0;
+    *e = fcache_put(c, path, fd, &st, now_ms);
+    return 1;
+}
+
+static void
+write_tmp_file(char *path, char *contents)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) return;
+    fputs(contents, f);
+    fclose(f);
+}
+
+void
+test_fcache()
+{
+    char a[] = "/tmp/mimino_fcache_a_XXXXXX";
+    char b[] = "/tmp/mimino_fcache_b_XXXXXX";
+    char c3[] = "/tmp/mimino_fcache_c_XXXXXX";
+    close(mkstemp(a));
+    close(mkstemp(b));
+    close(mkstemp(c3));
+    write_tmp_file(a, "aaaa");
+    write_tmp_file(b, "bbbb");
+    write_tmp_file(c3, "cccc");
+
+    esma_log_test("fcache_get()");
+
+    esma_log_subtest("Misses uncached paths and hits cached ones");
+    {
+        Fcache c;
+        Fcache_Entry *e = NULL;
+        fcache_init(&c, 4);
+        esma_assert(fcache_get(&c, a, 0) == NULL);
+        esma_assert(put_file(&c, a, 0, &e));
+        esma_assert(e != NULL);
+        esma_assert(e->refs == 1);
+
+        Fcache_Entry *hit = fcache_get(&c, a, 10);
+        esma_assert(hit == e);
+        esma_assert(hit->refs == 2);
+        esma_assert(fcache_get(&c, b, 10) == NULL);
+
+        fcache_release(hit);
+        fcache_release(e);
+        esma_assert(e->refs == 0);
+        free_fcache_parts(&c);
+    }
+
+    esma_log_subtest("Drops entries whose file changed on disk");
+    {
+        Fcache c;
+        Fcache_Entry *e = NULL;
+        fcache_init(&c, 4);
+        esma_assert(put_file(&c, a, 0, &e));
+        fcache_release(e);
+
+        write_tmp_file(a, "changed size");
+
+        // Not revalidated yet
+        e = fcache_get(&c, a, FCACHE_VALID_MS - 1);
+        esma_assert(e != NULL);
+        fcache_release(e);
+
+        esma_assert(fcache_get(&c, a, 2 * FCACHE_VALID_MS) == NULL);
+        esma_assert(c.n_entries == 0);
+        free_fcache_parts(&c);
+    }
+
+    esma_log_test("fcache_put()");
+
+    esma_log_subtest("Evicts the least recently used entry");
+    {
+        Fcache c;
+        Fcache_Entry *ea = NULL, *eb = NULL, *ec = NULL;
+        fcache_init(&c, 2);
+        esma_assert(put_file(&c, a, 0, &ea));
+        esma_assert(put_file(&c, b, 0, &eb));
+        fcache_release(eb);
+
+        // a is still referenced and more recently used than b
+        fcache_release(fcache_get(&c, a, 0));
+        esma_assert(put_file(&c, c3, 0, &ec));
+        esma_assert(c.n_entries == 2);
+        esma_assert(fcache_get(&c, b, 0) == NULL);
+
+        Fcache_Entry *hit = fcache_get(&c, a, 0);
+        esma_assert(hit == ea);
+        fcache_release(hit);
+
+        // Evicted while referenced, stays usable until released
+        fcache_release(fcache_get(&c, c3, 0));
+        esma_assert(put_file(&c, b, 0, &eb));
+        esma_assert(!ea->in_cache);
+        esma_assert(ea->fd != -1);
+        fcache_release(ea);
+
+        fcache_release(eb);
+        fcache_release(ec);
+        free_fcache_parts(&c);
+    }
+
+    esma_log_test("fcache_readers_low()");
+
+    esma_log_subtest("Knows the lowest sent offset only when all refs read");
+    {
+        Fcache c;
+        Fcache_Entry *e = NULL;
+        Fcache_Reader r1 = {.sent_end = 100}, r2 = {.sent_end = 40};
+        fcache_init(&c, 4);
+        esma_assert(put_file(&c, a, 0, &e));
+        fcache_get(&c, a, 0);
+        fcache_add_reader(e, &r1);
+        esma_assert(fcache_readers_low(e) == -1);
+
+        fcache_add_reader(e, &r2);
+        esma_assert(fcache_readers_low(e) == 40);
+        r2.sent_end = 200;
+        esma_assert(fcache_readers_low(e) == 100);
+
+        fcache_remove_reader(e, &r1);
+        fcache_release(e);
+        esma_assert(fcache_readers_low(e) == 200);
+
+        fcache_remove_reader(e, &r2);
+        fcache_release(e);
+        esma_assert(e->readers == NULL);
+        free_fcache_parts(&c);
+    }
+
+    esma_log_subtest("Does nothing when disabled");
+    {
+        Fcache c;
+        Fcache_Entry *e = NULL;
+        fcache_init(&c, 0);
+        int fd = open(a, O_RDONLY);
+        struct stat st;
+        fstat(fd, &st);
+        e = fcache_put(&c, a, fd, &st, 0);
+        esma_assert(e == NULL);
+        esma_assert(fcache_get(&c, a, 0) == NULL);
+        close(fd);
+        free_fcache_parts(&c);
+    }
+
+    unlink(a);
+    unlink(b);
+    unlink(c3);
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "esma.h"
+#include "buffer.h"
+#include "headers.h"
+
+// What format_http_date() replaced
+static int
+date_matches_strftime(time_t t)
+{
+    char want[64], got[HTTP_DATE_LEN + 1];
+    struct tm gmt;
+    strftime(want, sizeof(want), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&t, &gmt));
+    format_http_date(got, t);
+    return strcmp(want, got) == 0;
+}
+
+static int
+buf_is(Buffer *b, char *str)
+{
+    return b->n_items == strlen(str) && !memcmp(b->data, str, b->n_items);
+}
+
+void
+test_headers()
+{
+    esma_log_test("format_http_date()");
+    {
+        char date[HTTP_DATE_LEN + 1];
+        esma_assert(!strcmp(format_http_date(date, 784111777),
+                            "Sun, 06 Nov 1994 08:49:37 GMT"));
+
+        // Epoch, leap days, century years, before 1970
+        time_t times[] = { 0, 951782400, 951868800, 4107542400,
+                           1709164800, 253402300799, -1, -86401 };
+        int all_match = 1;
+        for (size_t i = 0; i < sizeof(times) / sizeof(times[0]); i++)
+            all_match &= date_matches_strftime(times[i]);
+        esma_assert(all_match);
+
+        // A few years worth of odd times
+        all_match = 1;
+        for (time_t t = 1600000000; t < 1700000000; t += 86400 * 3 + 4321)
+            all_match &= date_matches_strftime(t);
+        esma_assert(all_match);
+    }
+
+    esma_log_test("buf_append_num()");
+    {
+        long long nums[] = { 0, 7, 10, 99, 100, 12345, -1, -120,
+                             LLONG_MAX, LLONG_MIN };
+        char want[32];
+        int all_match = 1;
+        for (size_t i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+            Buffer *b = new_buf(4);
+            buf_append_num(b, nums[i]);
+            snprintf(want, sizeof(want), "%lld", nums[i]);
+            all_match &= buf_is(b, want);
+            free_buf(b);
+        }
+        esma_assert(all_match);
+    }
+
+    esma_log_test("buf_append_status_line()");
+    {
+        Buffer *b = new_buf(64);
+        buf_append_status_line(b, 416);
+        esma_assert(buf_is(b, "HTTP/1.1 416 Range Not Satisfiable\r\n"));
+        b->n_items = 0;
+        buf_append_status_line(b, 599);
+        esma_assert(buf_is(b, "HTTP/1.1 599 \r\n"));
+        free_buf(b);
+    }
+
+    esma_log_test("buf_append_common_headers()");
+    {
+        Header_Cache c;
+        header_cache_init(&c, 20);
+        Buffer *b = new_buf(64);
+
+        buf_append_common_headers(b, &c, 784111777, 1);
+        esma_assert(buf_is(b, "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                              "Server: mimino\r\n"
+                              "Keep-Alive: timeout=20\r\n"));
+
+        // The Date line follows the clock
+        b->n_items = 0;
+        buf_append_common_headers(b, &c, 784111778, 0);
+        esma_assert(buf_is(b, "Date: Sun, 06 Nov 1994 08:49:38 GMT\r\n"
+                              "Server: mimino\r\n"
+                              "Connection: close\r\n"));
+        free_buf(b);
+    }
+}
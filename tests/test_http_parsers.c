@@ -55,5 +55,286 @@ test_http_parsers()
         esma_assert(p == str + 9);
     }
 
+    esma_log_test("parse_http_request()");
+
+    esma_log_subtest("Slices fields out of the request buffer");
+    {
+        char *raw =
+            "GET /dir/file.txt HTTP/1.1\r\n"
+            "Host: localhost:8080\r\n"
+            "Connection: Close\r\n"
+            "\r\n";
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+        buf_append_str(req.buf, raw);
+        parse_http_request(&req);
+
+        esma_assert(req.error == NULL);
+        esma_assert(req_slice_eq(&req, req.method, "GET"));
+        esma_assert(req_slice_eq(&req, req.path, "/dir/file.txt"));
+        esma_assert(req_slice_eq(&req, req.version_number, "1.1"));
+        esma_assert(req_slice_eq(&req, req.host, "localhost:8080"));
+        esma_assert(req_slice_case_eq(&req, req.connection, "close"));
+        esma_assert(!req_slice_eq(&req, req.connection, "close"));
+        esma_assert(req.user_agent.len == 0);
+        esma_assert(req_slice(&req, req.path) == req.buf->data + 4);
+
+        reset_http_request(&req);
+        esma_assert(req.buf->n_items == 0);
+        esma_assert(req.host.len == 0);
+        free_buf(req.buf);
+    }
+
+    esma_log_subtest("Matches header names in any case, skips unknown ones");
+    {
+        char *raw =
+            "GET / HTTP/1.1\r\n"
+            "hOST: example.com\r\n"
+            "Hast: same hash as host\r\n"
+            "Accept-Language: en\r\n"
+            "USER-AGENT: test\r\n"
+            "\r\n";
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+        buf_append_str(req.buf, raw);
+        parse_http_request(&req);
+
+        esma_assert(req.error == NULL);
+        esma_assert(req_slice_eq(&req, req.host, "example.com"));
+        esma_assert(req_slice_eq(&req, req.user_agent, "test"));
+        esma_assert(req.accept.len == 0);
+        free_buf(req.buf);
+    }
+
+    esma_log_subtest("Rejects unknown HTTP versions");
+    {
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+        buf_append_str(req.buf, "GET / HTTP/1.10\r\n\r\n");
+        parse_http_request(&req);
+        esma_assert(req.error != NULL);
+        free_buf(req.buf);
+    }
+
+    esma_log_subtest("Resumes on every byte and stops at the end of the head");
+    {
+        char *raw =
+            "GET /index.html HTTP/1.1\r\n"
+            "Host: localhost\r\n"
+            "Range: bytes=0-9\r\n"
+            "\r\n"
+            "GET /next HTTP/1.1\r\n";
+        size_t head_len = strstr(raw, "\r\n\r\n") + 4 - raw;
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+
+        int partial_until_end = 1;
+        int status = P_PARTIAL;
+        for (size_t i = 0; i < strlen(raw) && status == P_PARTIAL; i++) {
+            buf_push(req.buf, raw[i]);
+            status = parse_http_request(&req);
+            if (status != P_PARTIAL && i + 1 != head_len)
+                partial_until_end = 0;
+        }
+        esma_assert(partial_until_end);
+        esma_assert(status == P_COMPLETE);
+        esma_assert(req.head_len == head_len);
+        esma_assert(req_slice_eq(&req, req.path, "/index.html"));
+        esma_assert(req_slice_eq(&req, req.host, "localhost"));
+        esma_assert(req.n_ranges == 1 && req.ranges[0].first == 0 &&
+                    req.ranges[0].last == 9);
+
+        // More bytes don't change a parsed request
+        buf_append_str(req.buf, raw + head_len);
+        esma_assert(parse_http_request(&req) == P_COMPLETE);
+        esma_assert(req_slice_eq(&req, req.path, "/index.html"));
+        free_buf(req.buf);
+    }
+
+    esma_log_subtest("Skips empty lines before the request line");
+    {
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+        buf_append_str(req.buf, "\r\nHEAD / HTTP/1.0\r\n\r\n");
+        esma_assert(parse_http_request(&req) == P_COMPLETE);
+        esma_assert(req_slice_eq(&req, req.method, "HEAD"));
+        free_buf(req.buf);
+    }
+
+    esma_log_subtest("Fails on a line without CR");
+    {
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+        buf_append_str(req.buf, "GET / HTTP/1.1\nHost: a\r\n\r\n");
+        esma_assert(parse_http_request(&req) == P_ERROR);
+        esma_assert(req.error != NULL);
+        free_buf(req.buf);
+    }
+
+    esma_log_subtest("Drops a Content-Length body, keeps the next request");
+    {
+        char *raw =
+            "POST /form HTTP/1.1\r\n"
+            "Content-Length: 11\r\n"
+            "\r\n"
+            "hello=world"
+            "GET /next HTTP/1.1\r\n\r\n";
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+        buf_append_str(req.buf, raw);
+
+        esma_assert(parse_http_request(&req) == P_COMPLETE);
+        esma_assert(req.content_length_given && req.content_length == 11);
+        esma_assert(req_slice_eq(&req, req.path, "/form"));
+
+        reset_http_request(&req);
+        esma_assert(parse_http_request(&req) == P_COMPLETE);
+        esma_assert(req_slice_eq(&req, req.path, "/next"));
+        free_buf(req.buf);
+    }
+
+    esma_log_subtest("Drops a chunked body fed byte by byte");
+    {
+        char *raw =
+            "POST / HTTP/1.1\r\n"
+            "Transfer-Encoding: gzip, Chunked\r\n"
+            "Content-Length: 3\r\n"
+            "\r\n"
+            "5;name=value\r\nhello\r\n"
+            "1A\r\nabcdefghijklmnopqrstuvwxyz\r\n"
+            "0\r\n"
+            "X-Trailer: yes\r\n"
+            "\r\n";
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+
+        int partial_until_end = 1;
+        int status = P_PARTIAL;
+        for (size_t i = 0; i < strlen(raw) && status == P_PARTIAL; i++) {
+            buf_push(req.buf, raw[i]);
+            status = parse_http_request(&req);
+            if (status != P_PARTIAL && i + 1 != strlen(raw))
+                partial_until_end = 0;
+        }
+        esma_assert(partial_until_end);
+        esma_assert(status == P_COMPLETE);
+        esma_assert(req.chunked);
+        esma_assert(req.must_close);
+
+        // Only the head is left in the buffer
+        esma_assert(req.buf->n_items == req.head_len);
+        free_buf(req.buf);
+    }
+
+    esma_log_subtest("Closes after chunked with Content-Length or on 1.0");
+    {
+        struct { char *raw; int must_close; } cases[] = {
+            { "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+              "0\r\n\r\n", 0 },
+            { "POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc", 0 },
+            { "POST / HTTP/1.1\r\nContent-Length: 5\r\n"
+              "Transfer-Encoding: chunked\r\n\r\n0\r\n\r\n", 1 },
+            { "POST / HTTP/1.0\r\nTransfer-Encoding: chunked\r\n\r\n"
+              "0\r\n\r\n", 1 },
+        };
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+            buf_append_str(req.buf, cases[i].raw);
+            esma_assert(parse_http_request(&req) == P_COMPLETE);
+            esma_assert(req.must_close == cases[i].must_close);
+            free_buf(req.buf);
+        }
+    }
+
+    esma_log_subtest("Fails on bad body framing with 400 or 501");
+    {
+        struct { char *raw; int status; } bad[] = {
+            { "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", 400 },
+            { "POST / HTTP/1.1\r\nContent-Length: \r\n\r\n", 400 },
+            { "POST / HTTP/1.1\r\nContent-Length: 2\r\n"
+              "Content-Length: 3\r\n\r\n", 400 },
+            { "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", 501 },
+            { "POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n"
+              "\r\n", 501 },
+            { "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+              "zz\r\n", 400 },
+            { "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+              "2\r\nabc\r\n", 400 },
+        };
+        for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+            Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+            buf_append_str(req.buf, bad[i].raw);
+            esma_assert(parse_http_request(&req) == P_ERROR);
+            esma_assert(req.error_status == bad[i].status);
+            free_buf(req.buf);
+        }
+    }
+
+    esma_log_subtest("Other errors don't set an error status");
+    {
+        Http_Request req = { .buf = new_buf(REQUEST_BUF_SIZE) };
+        buf_append_str(req.buf, "GET / HTTP/1.1\r\nHost a\r\n\r\n");
+        esma_assert(parse_http_request(&req) == P_ERROR);
+        esma_assert(req.error_status == 0);
+        free_buf(req.buf);
+    }
+
+    esma_log_test("parse_range_header()");
+    {
+        Http_Range r[RANGES_MAX + 1];
+        char *s = "bytes=0-99, 200-, -500,7-7";
+        esma_assert(parse_range_header(s, strlen(s), r) == 4);
+        esma_assert(r[0].first == 0 && r[0].last == 99);
+        esma_assert(r[1].first == 200 && r[1].last == -1);
+        esma_assert(r[2].first == -1 && r[2].last == 500);
+        esma_assert(r[3].first == 7 && r[3].last == 7);
+
+        // Ignored
+        char *bad[] = {
+            "bytes=", "bytes=-", "bytes=5-4", "bytes=1-2,", "bytes=1-2;3-4",
+            "items=0-1", "bytes=0-1,2-3,4-5,6-7,8-9,10-11,12-13,14-15,"
+            "16-17,18-19,20-21,22-23,24-25,26-27,28-29,30-31,32-33",
+        };
+        for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+            esma_assert(parse_range_header(bad[i], strlen(bad[i]), r) == 0);
+    }
+
+    esma_log_test("resolve_ranges()");
+
+    esma_log_subtest("Counts suffixes back from the end, caps at the end");
+    {
+        Http_Range r[] = { { -1, 300 }, { 100, 5000 } };
+        esma_assert(resolve_ranges(r, 1, 1000) == 1);
+        esma_assert(r[0].first == 700 && r[0].last == 999);
+        esma_assert(resolve_ranges(r + 1, 1, 1000) == 1);
+        esma_assert(r[1].first == 100 && r[1].last == 999);
+
+        Http_Range s[] = { { -1, 5000 } };
+        esma_assert(resolve_ranges(s, 1, 1000) == 1);
+        esma_assert(s[0].first == 0 && s[0].last == 999);
+    }
+
+    esma_log_subtest("Drops unsatisfiable ranges");
+    {
+        Http_Range r[] = { { 1000, -1 }, { -1, 0 }, { 999, 1500 } };
+        esma_assert(resolve_ranges(r, 3, 1000) == 1);
+        esma_assert(r[0].first == 999 && r[0].last == 999);
+
+        Http_Range s[] = { { 0, -1 }, { -1, 10 } };
+        esma_assert(resolve_ranges(s, 2, 0) == 0);
+    }
+
+    esma_log_subtest("Sorts and merges overlapping and nearby ranges");
+    {
+        Http_Range r[] = { { 5000, 5999 }, { 0, 99 }, { 50, 199 },
+                           { 250, 299 }, { -1, 10 } };
+        esma_assert(resolve_ranges(r, 5, 10000) == 3);
+        esma_assert(r[0].first == 0 && r[0].last == 299);
+        esma_assert(r[1].first == 5000 && r[1].last == 5999);
+        esma_assert(r[2].first == 9990 && r[2].last == 9999);
+    }
+
+    esma_log_test("get_header_handler()");
+    {
+        esma_assert(get_header_handler("Range", 5) != NULL);
+        esma_assert(get_header_handler("Connection", 10) != NULL);
+        esma_assert(get_header_handler("Connection", 9) == NULL);
+        esma_assert(get_header_handler("content-length", 14) != NULL);
+        esma_assert(get_header_handler("If-None-Match", 13) == NULL);
+        esma_assert(get_header_handler("", 0) == NULL);
+    }
+
 
 }
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "esma.h"
+#include "iopool.h"
+
+// Collects finished jobs until n of them are in or it times out
+static int
+wait_jobs(Io_Pool *p, Io_Job **jobs, int n)
+{
+    int got = 0;
+    while (got < n) {
+        struct pollfd pfd = { .fd = p->efd, .events = POLLIN };
+        if (poll(&pfd, 1, 2000) != 1) break;
+
+        Io_Job *job = io_pool_take_done(p);
+        while (job && got < n) {
+            jobs[got++] = job;
+            job = job->next;
+        }
+    }
+    return got;
+}
+
+void
+test_io_pool()
+{
+    char path[] = "/tmp/mimino_iopool_XXXXXX";
+    int fd = mkstemp(path);
+    char data[100000];
+    memset(data, 'x', sizeof(data));
+    if (write(fd, data, sizeof(data)) != (ssize_t) sizeof(data))
+        perror("write()");
+
+    esma_log_test("io_pool_init()");
+    {
+        Io_Pool p;
+        esma_assert(io_pool_init(&p, 0) == -1);
+        esma_assert(io_pool_init(&p, 2) == 0);
+        esma_assert(p.n_threads == 2);
+        esma_assert(p.efd != -1);
+        free_io_pool_parts(&p);
+    }
+
+    esma_log_test("io_pool_submit()");
+
+    esma_log_subtest("Finished jobs come back with their keys");
+    {
+        Io_Pool p;
+        Io_Job *jobs[3] = {0};
+        io_pool_init(&p, 2);
+        esma_assert(io_pool_submit(&p, fd, 0, 4096, 1) == 0);
+        esma_assert(io_pool_submit(&p, fd, 50000, 50000, 2) == 0);
+        esma_assert(io_pool_submit(&p, fd, 90000, 50000, 3) == 0);
+
+        esma_assert(wait_jobs(&p, jobs, 3) == 3);
+        uint64_t keys = 0;
+        for (int i = 0; i < 3; i++) {
+            if (!jobs[i]) continue;
+            keys |= 1 << jobs[i]->key;
+            esma_assert(jobs[i]->error == 0);
+            free(jobs[i]);
+        }
+        esma_assert(keys == ((1 << 1) | (1 << 2) | (1 << 3)));
+        free_io_pool_parts(&p);
+    }
+
+    esma_log_subtest("Jobs keep working after the caller's fd is closed");
+    {
+        Io_Pool p;
+        Io_Job *job = NULL;
+        io_pool_init(&p, 1);
+        int fd2 = open(path, O_RDONLY);
+        esma_assert(io_pool_submit(&p, fd2, 0, sizeof(data), 7) == 0);
+        close(fd2);
+
+        esma_assert(wait_jobs(&p, &job, 1) == 1);
+        esma_assert(job && job->key == 7 && job->error == 0);
+        free(job);
+        free_io_pool_parts(&p);
+    }
+
+    close(fd);
+    unlink(path);
+}
@@ -9,6 +9,13 @@ void test_decode_url();
 void test_buf_encode_url();
 void test_parse_args();
 void test_http_parsers();
+void test_timer();
+void test_fcache();
+void test_io_pool();
+void test_scan();
+void test_buf_pool();
+void test_headers();
+void test_server();
 
 int
 main(void)
@@ -17,5 +24,12 @@ main(void)
     esma_run_test(test_buf_encode_url);
     esma_run_test(test_parse_args);
     esma_run_test(test_http_parsers);
+    esma_run_test(test_timer);
+    esma_run_test(test_fcache);
+    esma_run_test(test_io_pool);
+    esma_run_test(test_scan);
+    esma_run_test(test_buf_pool);
+    esma_run_test(test_headers);
+    esma_run_test(test_server);
     esma_report();
 }
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esma.h"
+#include "scan.h"
+#include "ascii.h"
+
+// What the parser did before the scanners, byte by byte
+static char*
+slow_scan_path(char *p, char *end)
+{
+    while (p < end && (is_alnum(*p) || strchr("!$?&'()*+,;=%-._~:@/", *p)))
+        p++;
+    return p;
+}
+
+static char*
+slow_scan_header_name(char *p, char *end)
+{
+    while (p < end && (is_alpha(*p) || *p == '-'))
+        p++;
+    return p;
+}
+
+// Checks the scanners against the slow ones for every start and
+// length within buf, which covers both the vector and tail loops
+static int
+scanners_agree(char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        for (size_t n = 0; i + n <= len; n++) {
+            char *p = buf + i, *end = buf + i + n;
+            char *slow_cr = memchr(p, '\r', n);
+            char *slow_colon = memchr(p, ':', n);
+            char *slow_for = slow_cr ? slow_cr : end;
+            if (slow_colon && slow_colon < slow_for) slow_for = slow_colon;
+
+            if (scan_path(p, end) != slow_scan_path(p, end)) return 0;
+            if (scan_header_name(p, end) != slow_scan_header_name(p, end))
+                return 0;
+            if (scan_for(p, end, '\r', ':') != slow_for) return 0;
+        }
+    }
+    return 1;
+}
+
+void
+test_scan()
+{
+    esma_log_test("scan_char_class");
+    {
+        esma_assert(scan_char_class['a'] == (SCAN_PATH_CHAR | SCAN_HEADER_CHAR));
+        esma_assert(scan_char_class['-'] == (SCAN_PATH_CHAR | SCAN_HEADER_CHAR));
+        esma_assert(scan_char_class['/'] == SCAN_PATH_CHAR);
+        esma_assert(scan_char_class[' '] == 0);
+        esma_assert(scan_char_class['#'] == 0);
+        esma_assert(scan_char_class[0xC3] == 0);
+    }
+
+    esma_log_test("scan_path()");
+    {
+        char *s = "/some/fairly/long/path/to/a/file.html?x=1 HTTP/1.1";
+        esma_assert(scan_path(s, s + strlen(s)) == strchr(s, ' '));
+
+        char *t = "/path/with/a/quote/\"/in/it/somewhere/further";
+        esma_assert(scan_path(t, t + strlen(t)) == strchr(t, '"'));
+
+        char *u = "/all/of/this/is/a/valid/path/up/to/the/end";
+        esma_assert(scan_path(u, u + strlen(u)) == u + strlen(u));
+    }
+
+    esma_log_test("scan_header_name()");
+    {
+        char *s = "Accept-Encoding: gzip\r\n";
+        esma_assert(scan_header_name(s, s + strlen(s)) == strchr(s, ':'));
+
+        char *t = "X-Forwarded-For2: a\r\n";
+        esma_assert(scan_header_name(t, t + strlen(t)) == strchr(t, '2'));
+    }
+
+    esma_log_test("Scanners agree with byte by byte scanning");
+
+    esma_log_subtest("On request-like text");
+    {
+        char *s =
+            "GET /a/b/c.html?q=1 HTTP/1.1\r\nHost: localhost:8080\r\n"
+            "User-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\n\r\n";
+        esma_assert(scanners_agree(s, strlen(s)));
+    }
+
+    esma_log_subtest("On random bytes");
+    {
+        char buf[80];
+        srand(42);
+        for (size_t i = 0; i < sizeof(buf); i++) {
+            // Mostly valid chars, with some that aren't
+            buf[i] = rand() % 8 ? 'a' + rand() % 26 : rand() % 256;
+        }
+        esma_assert(scanners_agree(buf, sizeof(buf)));
+    }
+}
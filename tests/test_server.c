@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "esma.h"
+
+// Asks the kernel for a port nobody is listening on
+static int
+free_port()
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) return -1;
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        getsockname(sock, (struct sockaddr*) &addr, &len) == -1) {
+        close(sock);
+        return -1;
+    }
+    close(sock);
+    return ntohs(addr.sin_port);
+}
+
+// Connects to the server, retrying while it's starting up
+static int
+connect_server(int port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    for (int tries = 0; tries < 50; tries++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == -1) return -1;
+        if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+            return sock;
+        close(sock);
+        usleep(100 * 1000);
+    }
+    return -1;
+}
+
+// Starts ./mimino on port, serving the tests directory
+static pid_t
+start_server(int port, char *max_request_size)
+{
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        freopen("/dev/null", "w", stderr);
+        execl("./mimino", "mimino", "-q", "-p", port_str,
+              "--max-request-size", max_request_size,
+              "tests", (char*) NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void
+stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+// Sends all of data, returns 0 on error
+static int
+send_all(int sock, char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Reads until EOF, returns the number of bytes or -1 on error
+static ssize_t
+recv_all(int sock, char *buf, size_t cap)
+{
+    size_t got = 0;
+    while (got < cap) {
+        ssize_t n = recv(sock, buf + got, cap - got, 0);
+        if (n == 0) break;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        got += n;
+    }
+    buf[got < cap ? got : cap - 1] = '\0';
+    return got;
+}
+
+void
+test_server()
+{
+    int port = free_port();
+    pid_t pid = start_server(port, "4096");
+
+    esma_log_test("Request heads over max_request_size");
+
+    esma_log_subtest("Get a 431 without the connection being reset");
+    {
+        char *line = "GET / HTTP/1.1\r\nHost: localhost\r\nCookie: ";
+        size_t cookie_len = 100000;
+        size_t len = strlen(line) + cookie_len + 4;
+        char *req = malloc(len);
+        memcpy(req, line, strlen(line));
+        memset(req + strlen(line), 'a', cookie_len);
+        memcpy(req + len - 4, "\r\n\r\n", 4);
+
+        int sock = connect_server(port);
+        esma_assert(sock != -1);
+        esma_assert(send_all(sock, req, len));
+
+        char res[4096];
+        ssize_t n = recv_all(sock, res, sizeof(res));
+        esma_assert(n > 0);
+        esma_assert(strncmp(res, "HTTP/1.1 431 ", 13) == 0);
+
+        close(sock);
+        free(req);
+    }
+
+    esma_log_subtest("Get a 414 for a long request line");
+    {
+        char *method = "GET /";
+        size_t path_len = 100000;
+        char *rest = " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        size_t len = strlen(method) + path_len + strlen(rest);
+        char *req = malloc(len);
+        memcpy(req, method, strlen(method));
+        memset(req + strlen(method), 'a', path_len);
+        memcpy(req + strlen(method) + path_len, rest, strlen(rest));
+
+        int sock = connect_server(port);
+        esma_assert(sock != -1);
+        esma_assert(send_all(sock, req, len));
+
+        char res[4096];
+        ssize_t n = recv_all(sock, res, sizeof(res));
+        esma_assert(n > 0);
+        esma_assert(strncmp(res, "HTTP/1.1 414 ", 13) == 0);
+
+        close(sock);
+        free(req);
+    }
+
+    esma_log_test("Bad body framing");
+
+    esma_log_subtest("Get a 400 for a bad Content-Length and a 501 for gzip");
+    {
+        struct { char *raw; char *status_line; } cases[] = {
+            { "POST / HTTP/1.1\r\nHost: localhost\r\n"
+              "Content-Length: 1x\r\n\r\n", "HTTP/1.1 400 " },
+            { "POST / HTTP/1.1\r\nHost: localhost\r\n"
+              "Content-Length: 2\r\nContent-Length: 3\r\n\r\nabc",
+              "HTTP/1.1 400 " },
+            { "POST / HTTP/1.1\r\nHost: localhost\r\n"
+              "Transfer-Encoding: gzip\r\n\r\nabc", "HTTP/1.1 501 " },
+        };
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            int sock = connect_server(port);
+            esma_assert(sock != -1);
+            esma_assert(send_all(sock, cases[i].raw, strlen(cases[i].raw)));
+
+            // Read until the server closes, nothing is served after it
+            char res[4096];
+            ssize_t n = recv_all(sock, res, sizeof(res));
+            esma_assert(n > 0);
+            esma_assert(strncmp(res, cases[i].status_line,
+                                strlen(cases[i].status_line)) == 0);
+            esma_assert(strstr(res + 1, "HTTP/1.1 ") == NULL);
+            close(sock);
+        }
+    }
+
+    stop_server(pid);
+}
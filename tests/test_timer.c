@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+#include "esma.h"
+#include "timer.h"
+
+typedef struct {
+    uint64_t keys[16];
+    int n;
+} Expired;
+
+static void
+collect_expired(void *ctx, Timer *t)
+{
+    Expired *e = ctx;
+    if (e->n < 16)
+        e->keys[e->n] = t->key;
+    e->n++;
+}
+
+void
+test_timer()
+{
+    esma_log_test("timer_round_deadline()");
+    {
+        esma_assert(timer_round_deadline(0) == 0);
+        esma_assert(timer_round_deadline(1) == TIMER_TICK_MS);
+        esma_assert(timer_round_deadline(TIMER_TICK_MS) == TIMER_TICK_MS);
+        esma_assert(timer_round_deadline(TIMER_TICK_MS + 1) == 2 * TIMER_TICK_MS);
+    }
+
+    esma_log_test("timer_expire()");
+
+    esma_log_subtest("Expires only due timers");
+    {
+        Timer_Wheel w;
+        Expired e = {0};
+        timer_wheel_init(&w, 1000);
+        timer_add(&w, 1, 1000 + 2 * TIMER_TICK_MS);
+        timer_add(&w, 2, 1000 + 10 * TIMER_TICK_MS);
+
+        timer_expire(&w, 1000 + TIMER_TICK_MS, collect_expired, &e);
+        esma_assert(e.n == 0);
+
+        timer_expire(&w, 1000 + 2 * TIMER_TICK_MS, collect_expired, &e);
+        esma_assert(e.n == 1);
+        esma_assert(e.keys[0] == 1);
+
+        timer_expire(&w, 1000 + 20 * TIMER_TICK_MS, collect_expired, &e);
+        esma_assert(e.n == 2);
+        esma_assert(e.keys[1] == 2);
+        esma_assert(w.n_timers == 0);
+        free_timer_wheel_parts(&w);
+    }
+
+    esma_log_subtest("Keeps timers further away than one revolution");
+    {
+        Timer_Wheel w;
+        Expired e = {0};
+        long long far = (TIMER_WHEEL_SLOTS + 3) * TIMER_TICK_MS;
+        timer_wheel_init(&w, 0);
+        timer_add(&w, 7, far);
+
+        timer_expire(&w, 5 * TIMER_TICK_MS, collect_expired, &e);
+        esma_assert(e.n == 0);
+        esma_assert(w.n_timers == 1);
+
+        timer_expire(&w, far, collect_expired, &e);
+        esma_assert(e.n == 1);
+        esma_assert(e.keys[0] == 7);
+        free_timer_wheel_parts(&w);
+    }
+
+    esma_log_test("timer_next_timeout()");
+    {
+        Timer_Wheel w;
+        timer_wheel_init(&w, 0);
+        esma_assert(timer_next_timeout(&w, 0) == -1);
+
+        timer_add(&w, 1, 4 * TIMER_TICK_MS);
+        esma_assert(timer_next_timeout(&w, 0) == 4 * TIMER_TICK_MS);
+        esma_assert(timer_next_timeout(&w, TIMER_TICK_MS) == 3 * TIMER_TICK_MS);
+        free_timer_wheel_parts(&w);
+    }
+}
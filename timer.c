@@ -0,0 +1,116 @@
+// timer - timing wheel for connection deadlines
+
+#include <stdlib.h>
+#include "timer.h"
+#include "xmalloc.h"
+
+static long long
+to_tick(long long ms)
+{
+    return ms / TIMER_TICK_MS;
+}
+
+static void
+slot_push(Timer_Slot *slot, Timer t)
+{
+    if (slot->n_timers >= slot->n_alloc) {
+        slot->n_alloc = slot->n_alloc ? slot->n_alloc * 2 : 16;
+        slot->timers = xrealloc(slot->timers,
+                                sizeof(slot->timers[0]) * slot->n_alloc);
+    }
+    slot->timers[slot->n_timers++] = t;
+}
+
+void
+timer_wheel_init(Timer_Wheel *w, long long now_ms)
+{
+    *w = (Timer_Wheel) {0};
+    w->tick = to_tick(now_ms);
+}
+
+void
+free_timer_wheel_parts(Timer_Wheel *w)
+{
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+        free(w->slots[i].timers);
+    free(w->spare.timers);
+}
+
+// Rounds a deadline up to the end of its tick. Owners that round
+// their deadlines only need to re-arm once per tick.
+long long
+timer_round_deadline(long long deadline_ms)
+{
+    return (deadline_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS * TIMER_TICK_MS;
+}
+
+void
+timer_add(Timer_Wheel *w, uint64_t key, long long deadline_ms)
+{
+    long long tick = to_tick(deadline_ms);
+
+    // Already due, expire it on the next timer_expire()
+    if (tick <= w->tick)
+        tick = w->tick + 1;
+
+    Timer t = { .key = key, .deadline_ms = deadline_ms };
+    slot_push(w->slots + (tick % TIMER_WHEEL_SLOTS), t);
+    w->n_timers++;
+}
+
+// Calls cb for every timer whose deadline is <= now_ms. The
+// callback may add new timers.
+void
+timer_expire(Timer_Wheel *w, long long now_ms, Timer_Callback cb, void *ctx)
+{
+    long long now_tick = to_tick(now_ms);
+
+    // Don't go around the wheel more than once
+    if (now_tick - w->tick > TIMER_WHEEL_SLOTS)
+        w->tick = now_tick - TIMER_WHEEL_SLOTS;
+
+    while (w->tick < now_tick) {
+        w->tick++;
+        Timer_Slot *slot = w->slots + (w->tick % TIMER_WHEEL_SLOTS);
+        if (slot->n_timers == 0) continue;
+
+        // Swap the slot out so cb can add timers while we go
+        Timer_Slot expired = *slot;
+        *slot = w->spare;
+        slot->n_timers = 0;
+
+        for (size_t i = 0; i < expired.n_timers; i++) {
+            Timer *t = expired.timers + i;
+            w->n_timers--;
+            if (t->deadline_ms > now_ms) {
+                // Belongs to a later revolution of the wheel
+                timer_add(w, t->key, t->deadline_ms);
+                continue;
+            }
+            cb(ctx, t);
+        }
+
+        expired.n_timers = 0;
+        w->spare = expired;
+    }
+}
+
+// Returns milliseconds until the next tick that has timers in it
+// or -1 if there are no timers.
+int
+timer_next_timeout(Timer_Wheel *w, long long now_ms)
+{
+    if (w->n_timers == 0) return -1;
+
+    for (long long tick = w->tick + 1;
+         tick <= w->tick + TIMER_WHEEL_SLOTS;
+         tick++) {
+        if (w->slots[tick % TIMER_WHEEL_SLOTS].n_timers == 0)
+            continue;
+
+        long long timeout = tick * TIMER_TICK_MS - now_ms;
+        return timeout < 0 ? 0 : (int) timeout;
+    }
+
+    return -1;
+}
@@ -0,0 +1,46 @@
+#ifndef _MIMINO_TIMER_H
+#define _MIMINO_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_SLOTS 128
+#define TIMER_TICK_MS     250
+
+/*
+  A timing wheel with lazy deletion. Timers are never removed;
+  instead the owner remembers the deadline it currently wants and
+  ignores expired timers that don't match it. Re-arming is a push
+  into the slot of the new deadline, expiring is O(expired) plus
+  one visit per wheel revolution for far-away timers.
+*/
+
+typedef struct {
+    uint64_t key;
+    long long deadline_ms;
+} Timer;
+
+typedef struct {
+    Timer *timers;
+    size_t n_timers;
+    size_t n_alloc;
+} Timer_Slot;
+
+typedef struct {
+    Timer_Slot slots[TIMER_WHEEL_SLOTS];
+    Timer_Slot spare;   // swapped with a slot while it's expired
+    long long tick;     // last tick that was expired
+    size_t n_timers;
+} Timer_Wheel;
+
+typedef void (*Timer_Callback)(void *ctx, Timer *t);
+
+void timer_wheel_init(Timer_Wheel *w, long long now_ms);
+void free_timer_wheel_parts(Timer_Wheel *w);
+long long timer_round_deadline(long long deadline_ms);
+void timer_add(Timer_Wheel *w, uint64_t key, long long deadline_ms);
+void timer_expire(Timer_Wheel *w, long long now_ms,
+                  Timer_Callback cb, void *ctx);
+int timer_next_timeout(Timer_Wheel *w, long long now_ms);
+
+#endif // _MIMINO_TIMER_H